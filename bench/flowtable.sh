@@ -0,0 +1,161 @@
+#!/bin/sh
+#
+# Forwarding throughput through FULLCONENAT with and without nf_flow_table
+# software offload.
+#
+#   client (10.0.1.2) --veth-- nat (10.0.1.1 | 192.0.2.1) --veth-- server (192.0.2.2)
+#
+# After each run the conntracks are flushed, and the run fails unless the
+# mapping count in debugfs drops back to zero within -w seconds: every
+# mapping reference taken for an offloaded flow must be released again.
+#
+# Needs root, xt_FULLCONENAT loaded, debugfs mounted, the iptables
+# extension installed, nft with flowtable support, conntrack-tools and
+# iperf3. Results go to stdout and, with -o, to a file.
+#
+# usage: bench/flowtable.sh [-t seconds] [-P streams] [-w seconds] [-o output]
+
+set -e
+
+DURATION=10
+STREAMS=4
+EXPIRE_WAIT=30
+OUTPUT=
+DOMAINS=/sys/kernel/debug/xt_FULLCONENAT/domains
+
+while getopts "t:P:w:o:" opt; do
+	case $opt in
+	t) DURATION=$OPTARG ;;
+	P) STREAMS=$OPTARG ;;
+	w) EXPIRE_WAIT=$OPTARG ;;
+	o) OUTPUT=$OPTARG ;;
+	*) echo "usage: $0 [-t seconds] [-P streams] [-w seconds] [-o output]" >&2; exit 1 ;;
+	esac
+done
+
+if [ ! -r $DOMAINS ]; then
+	echo "cannot read $DOMAINS (xt_FULLCONENAT loaded, debugfs mounted?)" >&2
+	exit 1
+fi
+
+NS_CLIENT=fcn-client
+NS_NAT=fcn-nat
+NS_SERVER=fcn-server
+
+cleanup() {
+	ip netns pids $NS_SERVER 2>/dev/null | xargs -r kill 2>/dev/null || true
+	ip netns del $NS_CLIENT 2>/dev/null || true
+	ip netns del $NS_NAT 2>/dev/null || true
+	ip netns del $NS_SERVER 2>/dev/null || true
+}
+trap cleanup EXIT
+
+setup() {
+	cleanup
+	ip netns add $NS_CLIENT
+	ip netns add $NS_NAT
+	ip netns add $NS_SERVER
+
+	ip link add veth-c netns $NS_CLIENT type veth peer name veth-in netns $NS_NAT
+	ip link add veth-s netns $NS_SERVER type veth peer name veth-out netns $NS_NAT
+
+	ip -n $NS_CLIENT addr add 10.0.1.2/24 dev veth-c
+	ip -n $NS_CLIENT link set veth-c up
+	ip -n $NS_CLIENT link set lo up
+	ip -n $NS_CLIENT route add default via 10.0.1.1
+
+	ip -n $NS_NAT addr add 10.0.1.1/24 dev veth-in
+	ip -n $NS_NAT addr add 192.0.2.1/24 dev veth-out
+	ip -n $NS_NAT link set veth-in up
+	ip -n $NS_NAT link set veth-out up
+	ip -n $NS_NAT link set lo up
+	ip netns exec $NS_NAT sysctl -qw net.ipv4.ip_forward=1
+
+	ip -n $NS_SERVER addr add 192.0.2.2/24 dev veth-s
+	ip -n $NS_SERVER link set veth-s up
+	ip -n $NS_SERVER link set lo up
+
+	ip netns exec $NS_NAT iptables -t nat -A POSTROUTING -o veth-out -j FULLCONENAT
+	ip netns exec $NS_NAT iptables -t nat -A PREROUTING -i veth-out -j FULLCONENAT
+
+	ip netns exec $NS_SERVER iperf3 -s -D
+	sleep 1
+}
+
+enable_offload() {
+	ip netns exec $NS_NAT nft -f - <<EOF
+table inet fullconenat_bench {
+	flowtable ft {
+		hook ingress priority 0
+		devices = { veth-in, veth-out }
+	}
+	chain forward {
+		type filter hook forward priority 0; policy accept;
+		meta l4proto { tcp, udp } flow add @ft
+	}
+}
+EOF
+}
+
+# prints the receiver side throughput in Mbit/s
+run() {
+	ip netns exec $NS_CLIENT iperf3 -c 192.0.2.2 -t "$DURATION" -P "$STREAMS" -J "$@" \
+		| sed -n 's/.*"bits_per_second":[[:space:]]*\([0-9.e+]*\).*/\1/p' | tail -n 1 \
+		| awk '{ printf "%.0f", $1 / 1000000 }'
+}
+
+report() {
+	echo "$1" | tee -a "${OUTPUT:-/dev/null}"
+}
+
+# live mappings over all domains
+mappings() {
+	awk 'NR > 1 { n += $4 } END { print n + 0 }' $DOMAINS
+}
+
+# flush the conntracks of the run and wait for the GC to release every
+# mapping. fails the benchmark if references leaked.
+check_released() {
+	mode=$1
+
+	ip netns exec $NS_NAT conntrack -F >/dev/null 2>&1 || true
+
+	waited=0
+	while [ "$(mappings)" -ne 0 ] && [ $waited -lt "$EXPIRE_WAIT" ]; do
+		sleep 1
+		waited=$((waited + 1))
+	done
+
+	left=$(mappings)
+	if [ "$left" -ne 0 ]; then
+		report "$(printf '%-10s FAIL: %s mappings left %ss after the conntracks were flushed' \
+			"$mode" "$left" "$EXPIRE_WAIT")"
+		exit 1
+	fi
+	report "$(printf '%-10s all mappings released after %ss' "$mode" "$waited")"
+}
+
+bench() {
+	mode=$1
+
+	before=$(mappings)
+	if [ "$before" -ne 0 ]; then
+		echo "$before mappings exist before the run, unload other FULLCONENAT users first" >&2
+		exit 1
+	fi
+
+	tcp=$(run)
+	udp=$(run -u -b 0 -l 1400)
+	offloaded=$(ip netns exec $NS_NAT conntrack -L 2>/dev/null | grep -c OFFLOAD || true)
+	report "$(printf '%-10s tcp %8s Mbit/s   udp %8s Mbit/s   offloaded conntracks %s   mappings %s' \
+		"$mode" "$tcp" "$udp" "$offloaded" "$(mappings)")"
+
+	check_released "$mode"
+}
+
+setup
+bench baseline
+
+setup
+enable_offload
+bench flowtable
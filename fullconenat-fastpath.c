@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2018 Chion Tang <tech@chionlab.moe>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Loader for fullconenat_fastpath.bpf.o. Attaches the program to the
+ * tc ingress hook of the external interface and hands its mapping map
+ * to xt_FULLCONENAT, which keeps the map in sync from then on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+static const char *debugfs_dir = "/sys/kernel/debug/xt_FULLCONENAT";
+static const char *obj_path = "fullconenat_fastpath.bpf.o";
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+"Usage: %s -i ifname [-u] [-d debugfs-dir] [-o bpf-object]\n"
+"  -i	external interface\n"
+"  -u	detach the program and release the map instead\n"
+"  -d	xt_FULLCONENAT debugfs directory (default %s)\n"
+"  -o	BPF object (default %s)\n",
+		prog, debugfs_dir, obj_path);
+	exit(1);
+}
+
+/* tell the module which map to keep in sync, -1 to stop. */
+static int set_map_fd(int map_fd)
+{
+	char path[4096];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/bpf_map_fd", debugfs_dir);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open %s: %s "
+			"(is xt_FULLCONENAT loaded and debugfs mounted?)\n",
+			path, strerror(errno));
+		return -1;
+	}
+	if (dprintf(fd, "%d\n", map_fd) < 0) {
+		fprintf(stderr, "cannot hand map to xt_FULLCONENAT: %s\n", strerror(errno));
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+static int attach(int ifindex)
+{
+	DECLARE_LIBBPF_OPTS(bpf_tc_hook, hook, .ifindex = ifindex, .attach_point = BPF_TC_INGRESS);
+	DECLARE_LIBBPF_OPTS(bpf_tc_opts, opts, .handle = 1, .priority = 1);
+	struct bpf_object *obj;
+	struct bpf_program *prog;
+	struct bpf_map *map;
+	int err;
+
+	obj = bpf_object__open_file(obj_path, NULL);
+	if (libbpf_get_error(obj)) {
+		fprintf(stderr, "cannot open %s\n", obj_path);
+		return 1;
+	}
+	if (bpf_object__load(obj)) {
+		fprintf(stderr, "cannot load %s\n", obj_path);
+		return 1;
+	}
+
+	prog = bpf_object__find_program_by_name(obj, "fullconenat_ingress");
+	map = bpf_object__find_map_by_name(obj, "fullconenat_mappings");
+	if (prog == NULL || map == NULL) {
+		fprintf(stderr, "%s is not a fullconenat fast path object\n", obj_path);
+		return 1;
+	}
+
+	/* hand over the map before attaching, so the program never runs
+	 * against an empty map while mappings exist. */
+	if (set_map_fd(bpf_map__fd(map)) < 0)
+		return 1;
+
+	err = bpf_tc_hook_create(&hook);
+	if (err && err != -EEXIST) {
+		fprintf(stderr, "cannot create tc hook: %s\n", strerror(-err));
+		return 1;
+	}
+	opts.prog_fd = bpf_program__fd(prog);
+	opts.flags = BPF_TC_F_REPLACE;
+	err = bpf_tc_attach(&hook, &opts);
+	if (err) {
+		fprintf(stderr, "cannot attach tc program: %s\n", strerror(-err));
+		set_map_fd(-1);
+		return 1;
+	}
+
+	/* the tc filter and the module hold their own references now. */
+	bpf_object__close(obj);
+	return 0;
+}
+
+static int detach(int ifindex)
+{
+	DECLARE_LIBBPF_OPTS(bpf_tc_hook, hook, .ifindex = ifindex, .attach_point = BPF_TC_INGRESS);
+	DECLARE_LIBBPF_OPTS(bpf_tc_opts, opts, .handle = 1, .priority = 1);
+	int err;
+
+	/* remove the program first, it must not see a map nobody updates. */
+	err = bpf_tc_detach(&hook, &opts);
+	if (err && err != -ENOENT)
+		fprintf(stderr, "cannot detach tc program: %s\n", strerror(-err));
+
+	return set_map_fd(-1) < 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *ifname = NULL;
+	int opt, unload = 0;
+	unsigned int ifindex;
+
+	while ((opt = getopt(argc, argv, "i:ud:o:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			ifname = optarg;
+			break;
+		case 'u':
+			unload = 1;
+			break;
+		case 'd':
+			debugfs_dir = optarg;
+			break;
+		case 'o':
+			obj_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (ifname == NULL)
+		usage(argv[0]);
+
+	ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		fprintf(stderr, "no such interface: %s\n", ifname);
+		return 1;
+	}
+
+	return unload ? detach(ifindex) : attach(ifindex);
+}
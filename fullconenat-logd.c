@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2018 Chion Tang <tech@chionlab.moe>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Reference consumer of the xt_FULLCONENAT binary mapping log.
+ * Reads the per-CPU relay files in batches and writes one text line per
+ * record into gzip-compressed files, rotated by size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <zlib.h>
+#include "xt_FULLCONENAT.h"
+
+#define READ_BATCH_RECORDS	4096
+
+struct log_cpu {
+	long cpu;
+	int fd;
+	size_t carry;		/* bytes of a partial record kept in buf */
+	unsigned char buf[READ_BATCH_RECORDS * sizeof(struct xt_fullconenat_log_record)];
+};
+
+static const char *debugfs_dir = "/sys/kernel/debug/xt_FULLCONENAT";
+static const char *output_dir = ".";
+static unsigned long rotate_bytes = 64UL << 20;
+
+static gzFile output;
+static unsigned long output_written;
+static volatile sig_atomic_t stop;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+"Usage: %s [-d debugfs-dir] [-o output-dir] [-r rotate-MiB]\n"
+"  -d	xt_FULLCONENAT debugfs directory (default %s)\n"
+"  -o	directory receiving mappings-*.log.gz (default .)\n"
+"  -r	start a new file after this many MiB of text (default 64)\n",
+		prog, debugfs_dir);
+	exit(1);
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int open_output(void)
+{
+	char path[4096], stamp[32];
+	time_t now = time(NULL);
+
+	if (output != NULL)
+		gzclose(output);
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", gmtime(&now));
+	snprintf(path, sizeof(path), "%s/mappings-%s.log.gz", output_dir, stamp);
+
+	output = gzopen(path, "ab6");
+	if (output == NULL) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	output_written = 0;
+	return 0;
+}
+
+static const char *event_name(uint8_t event)
+{
+	switch (event) {
+	case XT_FULLCONENAT_LOG_ALLOCATE:
+		return "allocate";
+	case XT_FULLCONENAT_LOG_KILL:
+		return "kill";
+	default:
+		return "unknown";
+	}
+}
+
+static const char *proto_name(uint8_t l4proto)
+{
+	switch (l4proto) {
+	case IPPROTO_UDP:
+		return "udp";
+	case IPPROTO_TCP:
+		return "tcp";
+	case IPPROTO_UDPLITE:
+		return "udplite";
+	default:
+		return "unknown";
+	}
+}
+
+static void write_record(const struct xt_fullconenat_log_record *r)
+{
+	char int_addr[INET6_ADDRSTRLEN], ext_addr[INET6_ADDRSTRLEN];
+	int len;
+
+	if (!inet_ntop(r->family, r->int_addr, int_addr, sizeof(int_addr)))
+		strcpy(int_addr, "?");
+	if (!inet_ntop(r->family, r->ext_addr, ext_addr, sizeof(ext_addr)))
+		strcpy(ext_addr, "?");
+
+	len = gzprintf(output, "%" PRIu64 ".%09" PRIu64 " %s %s %s:%u %s:%u if=%d zone=%u\n",
+		(uint64_t)(r->timestamp_ns / 1000000000ULL),
+		(uint64_t)(r->timestamp_ns % 1000000000ULL),
+		event_name(r->event),
+		proto_name(r->l4proto),
+		int_addr, ntohs(r->int_port),
+		ext_addr, ntohs(r->ext_port),
+		r->ifindex, r->zone);
+	if (len > 0)
+		output_written += len;
+}
+
+/* drain everything currently readable from one CPU's relay file. */
+static int drain_cpu(struct log_cpu *c)
+{
+	const size_t rec_size = sizeof(struct xt_fullconenat_log_record);
+	struct xt_fullconenat_log_record r;
+	size_t avail, off;
+	ssize_t n;
+
+	for (;;) {
+		n = read(c->fd, c->buf + c->carry, sizeof(c->buf) - c->carry);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			return -1;
+		}
+		if (n == 0)
+			return 0;
+
+		avail = c->carry + n;
+		for (off = 0; off + rec_size <= avail; off += rec_size) {
+			memcpy(&r, c->buf + off, rec_size);
+			write_record(&r);
+		}
+		c->carry = avail - off;
+		memmove(c->buf, c->buf + off, c->carry);
+
+		if (output_written >= rotate_bytes && open_output() < 0)
+			return -1;
+	}
+}
+
+static unsigned long long read_dropped(void)
+{
+	char path[4096];
+	unsigned long long dropped = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/mapping_log_dropped", debugfs_dir);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%llu", &dropped) != 1)
+		dropped = 0;
+	fclose(f);
+	return dropped;
+}
+
+int main(int argc, char **argv)
+{
+	struct log_cpu *cpus;
+	struct pollfd *fds;
+	unsigned long long dropped, last_dropped = 0;
+	char path[4096];
+	long ncpus, nlogs, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:o:r:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			debugfs_dir = optarg;
+			break;
+		case 'o':
+			output_dir = optarg;
+			break;
+		case 'r':
+			rotate_bytes = strtoul(optarg, NULL, 10) << 20;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	cpus = calloc(ncpus, sizeof(*cpus));
+	fds = calloc(ncpus, sizeof(*fds));
+	if (cpus == NULL || fds == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/* relay only has buffer files for CPUs that were online when the
+	 * module was loaded or came up since. */
+	nlogs = 0;
+	for (i = 0; i < ncpus; i++) {
+		snprintf(path, sizeof(path), "%s/mapping_log%ld", debugfs_dir, i);
+		cpus[nlogs].fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (cpus[nlogs].fd < 0) {
+			if (errno != ENOENT) {
+				fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+				return 1;
+			}
+			continue;
+		}
+		cpus[nlogs].cpu = i;
+		fds[nlogs].fd = cpus[nlogs].fd;
+		fds[nlogs].events = POLLIN;
+		nlogs++;
+	}
+	if (nlogs == 0) {
+		fprintf(stderr, "no %s/mapping_log<cpu> found "
+			"(is xt_FULLCONENAT loaded with log_mappings=1?)\n",
+			debugfs_dir);
+		return 1;
+	}
+	if (nlogs < ncpus)
+		fprintf(stderr, "warning: reading %ld of %ld CPUs, the others are offline; "
+			"restart to pick up CPUs brought online later\n", nlogs, ncpus);
+
+	if (open_output() < 0)
+		return 1;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while (!stop) {
+		/* relay only wakes readers on sub-buffer switches, so also
+		 * drain on timeout to pick up partially filled sub-buffers. */
+		if (poll(fds, nlogs, 1000) < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < nlogs; i++) {
+			if (drain_cpu(&cpus[i]) < 0) {
+				fprintf(stderr, "read error on cpu %ld: %s\n", cpus[i].cpu, strerror(errno));
+				stop = 1;
+			}
+		}
+
+		dropped = read_dropped();
+		if (dropped != last_dropped) {
+			fprintf(stderr, "warning: %llu mapping log records dropped so far\n", dropped);
+			last_dropped = dropped;
+		}
+	}
+
+	gzclose(output);
+	return 0;
+}
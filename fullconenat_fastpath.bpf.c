@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2018 Chion Tang <tech@chionlab.moe>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Reference tc ingress program for the external interface. Inbound IPv4
+ * UDP packets hitting a mapping mirrored by xt_FULLCONENAT are DNATed and
+ * redirected to the internal host directly. Everything else, including
+ * packets the FIB cannot forward right away, is left to the slow path.
+ */
+
+#include <linux/bpf.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include "xt_FULLCONENAT.h"
+
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+
+#define IP_CSUM_OFF	(ETH_HLEN + offsetof(struct iphdr, check))
+#define IP_DST_OFF	(ETH_HLEN + offsetof(struct iphdr, daddr))
+#define IP_FRAG_MASK	0x3fff	/* MF and fragment offset */
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 65536);
+	__type(key, struct xt_fullconenat_bpf_key);
+	__type(value, struct xt_fullconenat_bpf_value);
+} fullconenat_mappings SEC(".maps");
+
+SEC("tc")
+int fullconenat_ingress(struct __sk_buff *skb)
+{
+	void *data = (void *)(long)skb->data;
+	void *data_end = (void *)(long)skb->data_end;
+	struct ethhdr *eth = data;
+	struct iphdr *iph;
+	struct udphdr *udph;
+	struct xt_fullconenat_bpf_key key = {};
+	struct xt_fullconenat_bpf_value *value;
+	struct bpf_fib_lookup fib = {};
+	__u32 l4_off, udp_csum_off;
+	__be32 old_addr;
+	__be16 old_port, old_ttl, new_ttl;
+
+	if ((void *)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IP))
+		return TC_ACT_OK;
+
+	iph = (void *)(eth + 1);
+	if ((void *)(iph + 1) > data_end || iph->ihl < 5 || iph->protocol != IPPROTO_UDP
+	    || (iph->frag_off & bpf_htons(IP_FRAG_MASK)) || iph->ttl <= 1)
+		return TC_ACT_OK;
+
+	l4_off = ETH_HLEN + iph->ihl * 4;
+	udph = data + l4_off;
+	if ((void *)(udph + 1) > data_end)
+		return TC_ACT_OK;
+
+	key.ext_addr = iph->daddr;
+	key.ext_port = udph->dest;
+	key.l4proto = IPPROTO_UDP;
+	value = bpf_map_lookup_elem(&fullconenat_mappings, &key);
+	if (value == NULL || value->ifindex != skb->ifindex)
+		return TC_ACT_OK;
+
+	/* route first, so that a packet the fast path cannot deliver is
+	 * handed to the stack untouched and still gets NATed by conntrack. */
+	fib.family = AF_INET;
+	fib.tos = iph->tos;
+	fib.l4_protocol = IPPROTO_UDP;
+	fib.sport = udph->source;
+	fib.dport = value->int_port;
+	fib.tot_len = bpf_ntohs(iph->tot_len);
+	fib.ipv4_src = iph->saddr;
+	fib.ipv4_dst = value->int_addr;
+	fib.ifindex = skb->ifindex;
+	if (bpf_fib_lookup(skb, &fib, sizeof(fib), 0) != BPF_FIB_LKUP_RET_SUCCESS)
+		return TC_ACT_OK;
+
+	old_addr = iph->daddr;
+	old_port = udph->dest;
+	old_ttl = *(__be16 *)&iph->ttl;
+	udp_csum_off = l4_off + offsetof(struct udphdr, check);
+
+	/* DNAT */
+	bpf_l4_csum_replace(skb, udp_csum_off, old_addr, value->int_addr,
+			    BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0 | sizeof(old_addr));
+	bpf_l4_csum_replace(skb, udp_csum_off, old_port, value->int_port,
+			    BPF_F_MARK_MANGLED_0 | sizeof(old_port));
+	bpf_l3_csum_replace(skb, IP_CSUM_OFF, old_addr, value->int_addr, sizeof(old_addr));
+	bpf_skb_store_bytes(skb, IP_DST_OFF, &value->int_addr, sizeof(value->int_addr), 0);
+	bpf_skb_store_bytes(skb, l4_off + offsetof(struct udphdr, dest), &value->int_port, sizeof(value->int_port), 0);
+
+	/* forward: decrement the TTL and rewrite the ethernet header */
+	data = (void *)(long)skb->data;
+	data_end = (void *)(long)skb->data_end;
+	eth = data;
+	iph = (void *)(eth + 1);
+	if ((void *)(iph + 1) > data_end)
+		return TC_ACT_SHOT;
+
+	iph->ttl--;
+	new_ttl = *(__be16 *)&iph->ttl;
+	bpf_l3_csum_replace(skb, IP_CSUM_OFF, old_ttl, new_ttl, sizeof(new_ttl));
+
+	bpf_skb_store_bytes(skb, offsetof(struct ethhdr, h_dest), fib.dmac, ETH_ALEN, 0);
+	bpf_skb_store_bytes(skb, offsetof(struct ethhdr, h_source), fib.smac, ETH_ALEN, 0);
+
+	return bpf_redirect(fib.ifindex, 0);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <netdb.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <xtables.h>
+#include <limits.h> /* INT_MAX in ip6_tables.h */
+#include <linux/netfilter_ipv6/ip6_tables.h>
+#include <linux/netfilter/nf_nat.h>
+#include "xt_FULLCONENAT.h"
+
+#ifndef NF_NAT_RANGE_PROTO_RANDOM_FULLY
+#define NF_NAT_RANGE_PROTO_RANDOM_FULLY (1 << 4)
+#endif
+
+enum {
+	O_TO_PORTS = 0,
+	O_RANDOM,
+	O_RANDOM_FULLY,
+	O_TO_SRC,
+	O_FILTER_MODE,
+	O_HAIRPIN,
+	O_CPU_PARTITION,
+	O_DOMAIN,
+	O_DOMAIN_BUCKETS,
+};
+
+static void FULLCONENAT_help(void)
+{
+	printf(
+"FULLCONENAT target options:\n"
+" --to-source [<ip6addr>[-<ip6addr>]]\n"
+"				Address to map source to.\n"
+" --to-ports <port>[-<port>]\n"
+"				Port (range) to map to.\n"
+" --random\n"
+"				Randomize source port.\n"
+" --random-fully\n"
+"				Fully randomize source port.\n"
+" --filter-mode {endpoint|address|address-port}\n"
+"				Inbound filtering behavior (RFC 4787).\n"
+"				Default is endpoint (full cone).\n"
+" --hairpin\n"
+"				NAT inside hosts reaching a mapped external\n"
+"				address in both directions (PREROUTING).\n"
+" --cpu-partition\n"
+"				Allocate ports from per-CPU slices of the range.\n");
+}
+
+static void FULLCONENAT_help_v1(void)
+{
+	FULLCONENAT_help();
+	printf(
+" --domain name\n"
+"				Keep mappings in the named domain, shared by all\n"
+"				rules naming it (e.g. one per uplink).\n"
+" --domain-buckets n\n"
+"				Hash table size of a new domain, a power of 2.\n");
+}
+
+static const struct xt_option_entry FULLCONENAT_opts[] = {
+	{.name = "to-ports", .id = O_TO_PORTS, .type = XTTYPE_STRING},
+	{.name = "random", .id = O_RANDOM, .type = XTTYPE_NONE},
+	{.name = "random-fully", .id = O_RANDOM_FULLY, .type = XTTYPE_NONE},
+	{.name = "to-source", .id = O_TO_SRC, .type = XTTYPE_STRING,
+	 .excl = 1 << O_HAIRPIN},
+	{.name = "filter-mode", .id = O_FILTER_MODE, .type = XTTYPE_STRING},
+	{.name = "hairpin", .id = O_HAIRPIN, .type = XTTYPE_NONE,
+	 .excl = 1 << O_TO_SRC},
+	{.name = "cpu-partition", .id = O_CPU_PARTITION, .type = XTTYPE_NONE},
+	XTOPT_TABLEEND,
+};
+
+static const struct xt_option_entry FULLCONENAT_opts_v1[] = {
+	{.name = "to-ports", .id = O_TO_PORTS, .type = XTTYPE_STRING},
+	{.name = "random", .id = O_RANDOM, .type = XTTYPE_NONE},
+	{.name = "random-fully", .id = O_RANDOM_FULLY, .type = XTTYPE_NONE},
+	{.name = "to-source", .id = O_TO_SRC, .type = XTTYPE_STRING,
+	 .excl = 1 << O_HAIRPIN},
+	{.name = "filter-mode", .id = O_FILTER_MODE, .type = XTTYPE_STRING},
+	{.name = "hairpin", .id = O_HAIRPIN, .type = XTTYPE_NONE,
+	 .excl = 1 << O_TO_SRC},
+	{.name = "cpu-partition", .id = O_CPU_PARTITION, .type = XTTYPE_NONE},
+	{.name = "domain", .id = O_DOMAIN, .type = XTTYPE_STRING,
+	 .min = 1, .max = XT_FULLCONENAT_DOMAIN_LEN - 1,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(struct xt_fullconenat_tginfo, domain)},
+	{.name = "domain-buckets", .id = O_DOMAIN_BUCKETS, .type = XTTYPE_UINT32,
+	 .also = 1 << O_DOMAIN, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(struct xt_fullconenat_tginfo, buckets)},
+	XTOPT_TABLEEND,
+};
+
+static void parse_to(const char *orig_arg, struct nf_nat_range *r)
+{
+	char *arg, *dash;
+	const struct in6_addr *ip;
+
+	arg = strdup(orig_arg);
+	if (arg == NULL)
+		xtables_error(RESOURCE_PROBLEM, "strdup");
+
+	r->flags |= NF_NAT_RANGE_MAP_IPS;
+	dash = strchr(arg, '-');
+
+	if (dash)
+		*dash = '\0';
+
+	ip = xtables_numeric_to_ip6addr(arg);
+	if (!ip)
+		xtables_error(PARAMETER_PROBLEM, "Bad IP address \"%s\"\n",
+			   arg);
+	r->min_addr.in6 = *ip;
+	if (dash) {
+		ip = xtables_numeric_to_ip6addr(dash+1);
+		if (!ip)
+			xtables_error(PARAMETER_PROBLEM, "Bad IP address \"%s\"\n",
+				   dash+1);
+		r->max_addr.in6 = *ip;
+	} else
+		r->max_addr = r->min_addr;
+
+	free(arg);
+}
+
+/* Parses ports */
+static void
+parse_ports(const char *arg, struct nf_nat_range *r)
+{
+	char *end;
+	unsigned int port, maxport;
+
+	r->flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
+
+	if (!xtables_strtoui(arg, &end, &port, 0, UINT16_MAX))
+		xtables_param_act(XTF_BAD_VALUE, "FULLCONENAT", "--to-ports", arg);
+
+	switch (*end) {
+	case '\0':
+		r->min_proto.tcp.port
+			= r->max_proto.tcp.port
+			= htons(port);
+		return;
+	case '-':
+		if (!xtables_strtoui(end + 1, NULL, &maxport, 0, UINT16_MAX))
+			break;
+
+		if (maxport < port)
+			break;
+
+		r->min_proto.tcp.port = htons(port);
+		r->max_proto.tcp.port = htons(maxport);
+		return;
+	default:
+		break;
+	}
+	xtables_param_act(XTF_BAD_VALUE, "FULLCONENAT", "--to-ports", arg);
+}
+
+static void
+parse_filter_mode(const char *arg, struct nf_nat_range *r)
+{
+	r->flags &= ~XT_FULLCONENAT_FILTER_MASK;
+
+	if (strcmp(arg, "endpoint") == 0)
+		return;
+	if (strcmp(arg, "address") == 0)
+		r->flags |= XT_FULLCONENAT_FILTER_ADDR;
+	else if (strcmp(arg, "address-port") == 0)
+		r->flags |= XT_FULLCONENAT_FILTER_ADDR_PORT;
+	else
+		xtables_param_act(XTF_BAD_VALUE, "FULLCONENAT", "--filter-mode", arg);
+}
+
+static const char *filter_mode_name(unsigned int flags)
+{
+	if (flags & XT_FULLCONENAT_FILTER_ADDR)
+		return "address";
+	if (flags & XT_FULLCONENAT_FILTER_ADDR_PORT)
+		return "address-port";
+	return NULL;
+}
+
+static void FULLCONENAT_parse_range(struct xt_option_call *cb, struct nf_nat_range *r)
+{
+	const struct ip6t_entry *entry = cb->xt_entry;
+	int portok;
+
+	if (entry->ipv6.proto == IPPROTO_TCP
+	    || entry->ipv6.proto == IPPROTO_UDP
+	    || entry->ipv6.proto == IPPROTO_UDPLITE
+	    || entry->ipv6.proto == IPPROTO_SCTP
+	    || entry->ipv6.proto == IPPROTO_DCCP
+	    || entry->ipv6.proto == IPPROTO_ICMPV6)
+		portok = 1;
+	else
+		portok = 0;
+
+	xtables_option_parse(cb);
+	switch (cb->entry->id) {
+	case O_TO_PORTS:
+		if (!portok)
+			xtables_error(PARAMETER_PROBLEM,
+				   "Need TCP, UDP, UDP-Lite, SCTP or DCCP with port specification");
+		parse_ports(cb->arg, r);
+		break;
+	case O_TO_SRC:
+		parse_to(cb->arg, r);
+		break;
+	case O_RANDOM:
+		r->flags |=  NF_NAT_RANGE_PROTO_RANDOM;
+		break;
+	case O_RANDOM_FULLY:
+		r->flags |=  NF_NAT_RANGE_PROTO_RANDOM_FULLY;
+		break;
+	case O_FILTER_MODE:
+		parse_filter_mode(cb->arg, r);
+		break;
+	case O_HAIRPIN:
+		r->flags |= XT_FULLCONENAT_HAIRPIN;
+		break;
+	case O_CPU_PARTITION:
+		r->flags |= XT_FULLCONENAT_CPU_PARTITION;
+		break;
+	}
+}
+
+static void FULLCONENAT_parse(struct xt_option_call *cb)
+{
+	FULLCONENAT_parse_range(cb, cb->data);
+}
+
+static void FULLCONENAT_parse_v1(struct xt_option_call *cb)
+{
+	struct xt_fullconenat_tginfo *info = cb->data;
+
+	FULLCONENAT_parse_range(cb, &info->range);
+
+	if (cb->entry->id == O_DOMAIN_BUCKETS
+	    && (info->buckets == 0 || (info->buckets & (info->buckets - 1)) != 0))
+		xtables_error(PARAMETER_PROBLEM,
+			   "--domain-buckets must be a power of 2");
+}
+
+static void
+FULLCONENAT_print_range(const struct nf_nat_range *r)
+{
+
+	if (r->flags & NF_NAT_RANGE_MAP_IPS) {
+		printf(" to:%s", xtables_ip6addr_to_numeric(&r->min_addr.in6));
+		if (memcmp(&r->max_addr, &r->min_addr, sizeof(r->min_addr)))
+			printf("-%s", xtables_ip6addr_to_numeric(&r->max_addr.in6));
+	}
+
+	if (r->flags & NF_NAT_RANGE_PROTO_SPECIFIED) {
+		printf(" masq ports: ");
+		printf("%hu", ntohs(r->min_proto.tcp.port));
+		if (r->max_proto.tcp.port != r->min_proto.tcp.port)
+			printf("-%hu", ntohs(r->max_proto.tcp.port));
+	}
+
+	if (r->flags & NF_NAT_RANGE_PROTO_RANDOM)
+		printf(" random");
+
+	if (r->flags & NF_NAT_RANGE_PROTO_RANDOM_FULLY)
+		printf(" random-fully");
+
+	if (filter_mode_name(r->flags))
+		printf(" filter-mode %s", filter_mode_name(r->flags));
+
+	if (r->flags & XT_FULLCONENAT_HAIRPIN)
+		printf(" hairpin");
+
+	if (r->flags & XT_FULLCONENAT_CPU_PARTITION)
+		printf(" cpu-partition");
+}
+
+static void
+FULLCONENAT_save_range(const struct nf_nat_range *r)
+{
+
+	if (r->flags & NF_NAT_RANGE_MAP_IPS) {
+		printf(" --to-source %s", xtables_ip6addr_to_numeric(&r->min_addr.in6));
+		if (memcmp(&r->max_addr, &r->min_addr, sizeof(r->min_addr)))
+			printf("-%s", xtables_ip6addr_to_numeric(&r->max_addr.in6));
+	}
+
+	if (r->flags & NF_NAT_RANGE_PROTO_SPECIFIED) {
+		printf(" --to-ports %hu", ntohs(r->min_proto.tcp.port));
+		if (r->max_proto.tcp.port != r->min_proto.tcp.port)
+			printf("-%hu", ntohs(r->max_proto.tcp.port));
+	}
+
+	if (r->flags & NF_NAT_RANGE_PROTO_RANDOM)
+		printf(" --random");
+
+	if (r->flags & NF_NAT_RANGE_PROTO_RANDOM_FULLY)
+		printf(" --random-fully");
+
+	if (filter_mode_name(r->flags))
+		printf(" --filter-mode %s", filter_mode_name(r->flags));
+
+	if (r->flags & XT_FULLCONENAT_HAIRPIN)
+		printf(" --hairpin");
+
+	if (r->flags & XT_FULLCONENAT_CPU_PARTITION)
+		printf(" --cpu-partition");
+}
+
+static void
+FULLCONENAT_print(const void *ip, const struct xt_entry_target *target,
+                 int numeric)
+{
+	FULLCONENAT_print_range((const void *)target->data);
+}
+
+static void
+FULLCONENAT_save(const void *ip, const struct xt_entry_target *target)
+{
+	FULLCONENAT_save_range((const void *)target->data);
+}
+
+static void
+FULLCONENAT_print_v1(const void *ip, const struct xt_entry_target *target,
+                    int numeric)
+{
+	const struct xt_fullconenat_tginfo *info = (const void *)target->data;
+
+	FULLCONENAT_print_range(&info->range);
+
+	if (info->domain[0] != '\0')
+		printf(" domain %s", info->domain);
+
+	if (info->buckets != 0)
+		printf(" domain-buckets %u", info->buckets);
+}
+
+static void
+FULLCONENAT_save_v1(const void *ip, const struct xt_entry_target *target)
+{
+	const struct xt_fullconenat_tginfo *info = (const void *)target->data;
+
+	FULLCONENAT_save_range(&info->range);
+
+	if (info->domain[0] != '\0')
+		printf(" --domain %s", info->domain);
+
+	if (info->buckets != 0)
+		printf(" --domain-buckets %u", info->buckets);
+}
+
+static struct xtables_target fullconenat_tg6_reg[] = {
+	{
+		.name		= "FULLCONENAT",
+		.version	= XTABLES_VERSION,
+		.family		= NFPROTO_IPV6,
+		.revision	= 0,
+		.size		= XT_ALIGN(sizeof(struct nf_nat_range)),
+		.userspacesize	= XT_ALIGN(sizeof(struct nf_nat_range)),
+		.help		= FULLCONENAT_help,
+		.x6_parse	= FULLCONENAT_parse,
+		.print		= FULLCONENAT_print,
+		.save		= FULLCONENAT_save,
+		.x6_options	= FULLCONENAT_opts,
+	},
+	{
+		.name		= "FULLCONENAT",
+		.version	= XTABLES_VERSION,
+		.family		= NFPROTO_IPV6,
+		.revision	= 1,
+		.size		= XT_ALIGN(sizeof(struct xt_fullconenat_tginfo)),
+		.userspacesize	= offsetof(struct xt_fullconenat_tginfo, d),
+		.help		= FULLCONENAT_help_v1,
+		.x6_parse	= FULLCONENAT_parse_v1,
+		.print		= FULLCONENAT_print_v1,
+		.save		= FULLCONENAT_save_v1,
+		.x6_options	= FULLCONENAT_opts_v1,
+	},
+};
+
+void _init(void)
+{
+	xtables_register_targets(fullconenat_tg6_reg, ARRAY_SIZE(fullconenat_tg6_reg));
+}
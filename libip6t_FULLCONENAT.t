@@ -0,0 +1,19 @@
+:PREROUTING,POSTROUTING
+*nat
+-j FULLCONENAT;=;OK
+-j FULLCONENAT --random;=;OK
+-j FULLCONENAT --random-fully;=;OK
+-p tcp -j FULLCONENAT --to-ports 1024;=;OK
+-p udp -j FULLCONENAT --to-ports 1024-65535;=;OK
+-p udp -j FULLCONENAT --to-ports 1024-65536;;FAIL
+-p udp -j FULLCONENAT --to-ports -1;;FAIL
+-p udp -j FULLCONENAT --to-source 2001:db8::1;=;OK
+-p udp -j FULLCONENAT --to-source 2001:db8::1-2001:db8::ff;=;OK
+-p udp -j FULLCONENAT --filter-mode address-port;=;OK
+-p udp -j FULLCONENAT --domain wan1;=;OK
+:PREROUTING
+-p udp -j FULLCONENAT --hairpin;=;OK
+-p udp -j FULLCONENAT --hairpin --to-ports 40000-60000;-p udp -j FULLCONENAT --to-ports 40000-60000 --hairpin;OK
+-p udp -j FULLCONENAT --hairpin --to-source 2001:db8::1;;FAIL
+:POSTROUTING
+-p udp -j FULLCONENAT --hairpin;;FAIL
@@ -7,6 +7,7 @@
 #include <limits.h> /* INT_MAX in ip_tables.h */
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter/nf_nat.h>
+#include "xt_FULLCONENAT.h"
 
 #ifndef NF_NAT_RANGE_PROTO_RANDOM_FULLY
 #define NF_NAT_RANGE_PROTO_RANDOM_FULLY (1 << 4)
@@ -17,6 +18,11 @@ enum {
 	O_RANDOM,
 	O_RANDOM_FULLY,
 	O_TO_SRC,
+	O_FILTER_MODE,
+	O_HAIRPIN,
+	O_CPU_PARTITION,
+	O_DOMAIN,
+	O_DOMAIN_BUCKETS,
 };
 
 static void FULLCONENAT_help(void)
@@ -30,18 +36,61 @@ static void FULLCONENAT_help(void)
 " --random\n"
 "				Randomize source port.\n"
 " --random-fully\n"
-"				Fully randomize source port.\n");
+"				Fully randomize source port.\n"
+" --filter-mode {endpoint|address|address-port}\n"
+"				Inbound filtering behavior (RFC 4787).\n"
+"				Default is endpoint (full cone).\n"
+" --hairpin\n"
+"				NAT inside hosts reaching a mapped external\n"
+"				address in both directions (PREROUTING).\n"
+" --cpu-partition\n"
+"				Allocate ports from per-CPU slices of the range.\n");
+}
+
+static void FULLCONENAT_help_v1(void)
+{
+	FULLCONENAT_help();
+	printf(
+" --domain name\n"
+"				Keep mappings in the named domain, shared by all\n"
+"				rules naming it (e.g. one per uplink).\n"
+" --domain-buckets n\n"
+"				Hash table size of a new domain, a power of 2.\n");
 }
 
 static const struct xt_option_entry FULLCONENAT_opts[] = {
 	{.name = "to-ports", .id = O_TO_PORTS, .type = XTTYPE_STRING},
 	{.name = "random", .id = O_RANDOM, .type = XTTYPE_NONE},
 	{.name = "random-fully", .id = O_RANDOM_FULLY, .type = XTTYPE_NONE},
-	{.name = "to-source", .id = O_TO_SRC, .type = XTTYPE_STRING},
+	{.name = "to-source", .id = O_TO_SRC, .type = XTTYPE_STRING,
+	 .excl = 1 << O_HAIRPIN},
+	{.name = "filter-mode", .id = O_FILTER_MODE, .type = XTTYPE_STRING},
+	{.name = "hairpin", .id = O_HAIRPIN, .type = XTTYPE_NONE,
+	 .excl = 1 << O_TO_SRC},
+	{.name = "cpu-partition", .id = O_CPU_PARTITION, .type = XTTYPE_NONE},
 	XTOPT_TABLEEND,
 };
 
-static void parse_to(const char *orig_arg, struct nf_nat_ipv4_multi_range_compat *mr)
+static const struct xt_option_entry FULLCONENAT_opts_v1[] = {
+	{.name = "to-ports", .id = O_TO_PORTS, .type = XTTYPE_STRING},
+	{.name = "random", .id = O_RANDOM, .type = XTTYPE_NONE},
+	{.name = "random-fully", .id = O_RANDOM_FULLY, .type = XTTYPE_NONE},
+	{.name = "to-source", .id = O_TO_SRC, .type = XTTYPE_STRING,
+	 .excl = 1 << O_HAIRPIN},
+	{.name = "filter-mode", .id = O_FILTER_MODE, .type = XTTYPE_STRING},
+	{.name = "hairpin", .id = O_HAIRPIN, .type = XTTYPE_NONE,
+	 .excl = 1 << O_TO_SRC},
+	{.name = "cpu-partition", .id = O_CPU_PARTITION, .type = XTTYPE_NONE},
+	{.name = "domain", .id = O_DOMAIN, .type = XTTYPE_STRING,
+	 .min = 1, .max = XT_FULLCONENAT_DOMAIN_LEN - 1,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(struct xt_fullconenat_tginfo, domain)},
+	{.name = "domain-buckets", .id = O_DOMAIN_BUCKETS, .type = XTTYPE_UINT32,
+	 .also = 1 << O_DOMAIN, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(struct xt_fullconenat_tginfo, buckets)},
+	XTOPT_TABLEEND,
+};
+
+static void parse_to(const char *orig_arg, struct nf_nat_range *r)
 {
 	char *arg, *dash, *error;
 	const struct in_addr *ip;
@@ -50,7 +99,7 @@ static void parse_to(const char *orig_arg, struct nf_nat_ipv4_multi_range_compat
 	if (arg == NULL)
 		xtables_error(RESOURCE_PROBLEM, "strdup");
 
-	mr->range[0].flags |= NF_NAT_RANGE_MAP_IPS;
+	r->flags |= NF_NAT_RANGE_MAP_IPS;
 	dash = strchr(arg, '-');
 
 	if (dash)
@@ -60,15 +109,15 @@ static void parse_to(const char *orig_arg, struct nf_nat_ipv4_multi_range_compat
 	if (!ip)
 		xtables_error(PARAMETER_PROBLEM, "Bad IP address \"%s\"\n",
 			   arg);
-	mr->range[0].min_ip = ip->s_addr;
+	r->min_addr.ip = ip->s_addr;
 	if (dash) {
 		ip = xtables_numeric_to_ipaddr(dash+1);
 		if (!ip)
 			xtables_error(PARAMETER_PROBLEM, "Bad IP address \"%s\"\n",
 				   dash+1);
-		mr->range[0].max_ip = ip->s_addr;
+		r->max_addr.ip = ip->s_addr;
 	} else
-		mr->range[0].max_ip = mr->range[0].min_ip;
+		r->max_addr.ip = r->min_addr.ip;
 
 	free(arg);
 }
@@ -81,22 +130,43 @@ static void FULLCONENAT_init(struct xt_entry_target *t)
 	mr->rangesize = 1;
 }
 
+/* revision 0 keeps the legacy IPv4 range, the option handling below
+ * works on struct nf_nat_range for both revisions. */
+static void range_from_compat(struct nf_nat_range *r, const struct nf_nat_ipv4_range *c)
+{
+	memset(r, 0, sizeof(*r));
+	r->flags = c->flags;
+	r->min_addr.ip = c->min_ip;
+	r->max_addr.ip = c->max_ip;
+	r->min_proto = c->min;
+	r->max_proto = c->max;
+}
+
+static void range_to_compat(struct nf_nat_ipv4_range *c, const struct nf_nat_range *r)
+{
+	c->flags = r->flags;
+	c->min_ip = r->min_addr.ip;
+	c->max_ip = r->max_addr.ip;
+	c->min = r->min_proto;
+	c->max = r->max_proto;
+}
+
 /* Parses ports */
 static void
-parse_ports(const char *arg, struct nf_nat_ipv4_multi_range_compat *mr)
+parse_ports(const char *arg, struct nf_nat_range *r)
 {
 	char *end;
 	unsigned int port, maxport;
 
-	mr->range[0].flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
+	r->flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
 
 	if (!xtables_strtoui(arg, &end, &port, 0, UINT16_MAX))
 		xtables_param_act(XTF_BAD_VALUE, "FULLCONENAT", "--to-ports", arg);
 
 	switch (*end) {
 	case '\0':
-		mr->range[0].min.tcp.port
-			= mr->range[0].max.tcp.port
+		r->min_proto.tcp.port
+			= r->max_proto.tcp.port
 			= htons(port);
 		return;
 	case '-':
@@ -106,8 +176,8 @@ parse_ports(const char *arg, struct nf_nat_ipv4_multi_range_compat *mr)
 		if (maxport < port)
 			break;
 
-		mr->range[0].min.tcp.port = htons(port);
-		mr->range[0].max.tcp.port = htons(maxport);
+		r->min_proto.tcp.port = htons(port);
+		r->max_proto.tcp.port = htons(maxport);
 		return;
 	default:
 		break;
@@ -115,14 +185,38 @@ parse_ports(const char *arg, struct nf_nat_ipv4_multi_range_compat *mr)
 	xtables_param_act(XTF_BAD_VALUE, "FULLCONENAT", "--to-ports", arg);
 }
 
-static void FULLCONENAT_parse(struct xt_option_call *cb)
+static void
+parse_filter_mode(const char *arg, struct nf_nat_range *r)
+{
+	r->flags &= ~XT_FULLCONENAT_FILTER_MASK;
+
+	if (strcmp(arg, "endpoint") == 0)
+		return;
+	if (strcmp(arg, "address") == 0)
+		r->flags |= XT_FULLCONENAT_FILTER_ADDR;
+	else if (strcmp(arg, "address-port") == 0)
+		r->flags |= XT_FULLCONENAT_FILTER_ADDR_PORT;
+	else
+		xtables_param_act(XTF_BAD_VALUE, "FULLCONENAT", "--filter-mode", arg);
+}
+
+static const char *filter_mode_name(unsigned int flags)
+{
+	if (flags & XT_FULLCONENAT_FILTER_ADDR)
+		return "address";
+	if (flags & XT_FULLCONENAT_FILTER_ADDR_PORT)
+		return "address-port";
+	return NULL;
+}
+
+static void FULLCONENAT_parse_range(struct xt_option_call *cb, struct nf_nat_range *r)
 {
 	const struct ipt_entry *entry = cb->xt_entry;
 	int portok;
-	struct nf_nat_ipv4_multi_range_compat *mr = cb->data;
 
 	if (entry->ip.proto == IPPROTO_TCP
 	    || entry->ip.proto == IPPROTO_UDP
+	    || entry->ip.proto == IPPROTO_UDPLITE
 	    || entry->ip.proto == IPPROTO_SCTP
 	    || entry->ip.proto == IPPROTO_DCCP
 	    || entry->ip.proto == IPPROTO_ICMP)
@@ -135,44 +229,66 @@ static void FULLCONENAT_parse(struct xt_option_call *cb)
 	case O_TO_PORTS:
 		if (!portok)
 			xtables_error(PARAMETER_PROBLEM,
-				   "Need TCP, UDP, SCTP or DCCP with port specification");
-		parse_ports(cb->arg, mr);
+				   "Need TCP, UDP, UDP-Lite, SCTP or DCCP with port specification");
+		parse_ports(cb->arg, r);
 		break;
 	case O_TO_SRC:
-		parse_to(cb->arg, mr);
+		parse_to(cb->arg, r);
 		break;
 	case O_RANDOM:
-		mr->range[0].flags |=  NF_NAT_RANGE_PROTO_RANDOM;
+		r->flags |=  NF_NAT_RANGE_PROTO_RANDOM;
 		break;
 	case O_RANDOM_FULLY:
-		mr->range[0].flags |=  NF_NAT_RANGE_PROTO_RANDOM_FULLY;
+		r->flags |=  NF_NAT_RANGE_PROTO_RANDOM_FULLY;
+		break;
+	case O_FILTER_MODE:
+		parse_filter_mode(cb->arg, r);
+		break;
+	case O_HAIRPIN:
+		r->flags |= XT_FULLCONENAT_HAIRPIN;
+		break;
+	case O_CPU_PARTITION:
+		r->flags |= XT_FULLCONENAT_CPU_PARTITION;
 		break;
 	}
 }
 
-static void
-FULLCONENAT_print(const void *ip, const struct xt_entry_target *target,
-                 int numeric)
+static void FULLCONENAT_parse(struct xt_option_call *cb)
 {
-	const struct nf_nat_ipv4_multi_range_compat *mr = (const void *)target->data;
-	const struct nf_nat_ipv4_range *r = &mr->range[0];
+	struct nf_nat_ipv4_multi_range_compat *mr = cb->data;
+	struct nf_nat_range r;
+
+	range_from_compat(&r, &mr->range[0]);
+	FULLCONENAT_parse_range(cb, &r);
+	range_to_compat(&mr->range[0], &r);
+}
+
+static void FULLCONENAT_parse_v1(struct xt_option_call *cb)
+{
+	struct xt_fullconenat_tginfo *info = cb->data;
+
+	FULLCONENAT_parse_range(cb, &info->range);
 
+	if (cb->entry->id == O_DOMAIN_BUCKETS
+	    && (info->buckets == 0 || (info->buckets & (info->buckets - 1)) != 0))
+		xtables_error(PARAMETER_PROBLEM,
+			   "--domain-buckets must be a power of 2");
+}
+
+static void
+FULLCONENAT_print_range(const struct nf_nat_range *r)
+{
 	if (r->flags & NF_NAT_RANGE_MAP_IPS) {
-		struct in_addr a;
-
-		a.s_addr = r->min_ip;
-		printf(" to:%s", xtables_ipaddr_to_numeric(&a));
-		if (r->max_ip != r->min_ip) {
-			a.s_addr = r->max_ip;
-			printf("-%s", xtables_ipaddr_to_numeric(&a));
-		}
+		printf(" to:%s", xtables_ipaddr_to_numeric(&r->min_addr.in));
+		if (r->max_addr.ip != r->min_addr.ip)
+			printf("-%s", xtables_ipaddr_to_numeric(&r->max_addr.in));
 	}
 
 	if (r->flags & NF_NAT_RANGE_PROTO_SPECIFIED) {
 		printf(" masq ports: ");
-		printf("%hu", ntohs(r->min.tcp.port));
-		if (r->max.tcp.port != r->min.tcp.port)
-			printf("-%hu", ntohs(r->max.tcp.port));
+		printf("%hu", ntohs(r->min_proto.tcp.port));
+		if (r->max_proto.tcp.port != r->min_proto.tcp.port)
+			printf("-%hu", ntohs(r->max_proto.tcp.port));
 	}
 
 	if (r->flags & NF_NAT_RANGE_PROTO_RANDOM)
@@ -180,29 +296,30 @@ FULLCONENAT_print(const void *ip, const struct xt_entry_target *target,
 
 	if (r->flags & NF_NAT_RANGE_PROTO_RANDOM_FULLY)
 		printf(" random-fully");
+
+	if (filter_mode_name(r->flags))
+		printf(" filter-mode %s", filter_mode_name(r->flags));
+
+	if (r->flags & XT_FULLCONENAT_HAIRPIN)
+		printf(" hairpin");
+
+	if (r->flags & XT_FULLCONENAT_CPU_PARTITION)
+		printf(" cpu-partition");
 }
 
 static void
-FULLCONENAT_save(const void *ip, const struct xt_entry_target *target)
+FULLCONENAT_save_range(const struct nf_nat_range *r)
 {
-	const struct nf_nat_ipv4_multi_range_compat *mr = (const void *)target->data;
-	const struct nf_nat_ipv4_range *r = &mr->range[0];
-
 	if (r->flags & NF_NAT_RANGE_MAP_IPS) {
-		struct in_addr a;
-
-		a.s_addr = r->min_ip;
-		printf(" --to-source %s", xtables_ipaddr_to_numeric(&a));
-		if (r->max_ip != r->min_ip) {
-			a.s_addr = r->max_ip;
-			printf("-%s", xtables_ipaddr_to_numeric(&a));
-		}
+		printf(" --to-source %s", xtables_ipaddr_to_numeric(&r->min_addr.in));
+		if (r->max_addr.ip != r->min_addr.ip)
+			printf("-%s", xtables_ipaddr_to_numeric(&r->max_addr.in));
 	}
 
 	if (r->flags & NF_NAT_RANGE_PROTO_SPECIFIED) {
-		printf(" --to-ports %hu", ntohs(r->min.tcp.port));
-		if (r->max.tcp.port != r->min.tcp.port)
-			printf("-%hu", ntohs(r->max.tcp.port));
+		printf(" --to-ports %hu", ntohs(r->min_proto.tcp.port));
+		if (r->max_proto.tcp.port != r->min_proto.tcp.port)
+			printf("-%hu", ntohs(r->max_proto.tcp.port));
 	}
 
 	if (r->flags & NF_NAT_RANGE_PROTO_RANDOM)
@@ -210,23 +327,98 @@ FULLCONENAT_save(const void *ip, const struct xt_entry_target *target)
 
 	if (r->flags & NF_NAT_RANGE_PROTO_RANDOM_FULLY)
 		printf(" --random-fully");
+
+	if (filter_mode_name(r->flags))
+		printf(" --filter-mode %s", filter_mode_name(r->flags));
+
+	if (r->flags & XT_FULLCONENAT_HAIRPIN)
+		printf(" --hairpin");
+
+	if (r->flags & XT_FULLCONENAT_CPU_PARTITION)
+		printf(" --cpu-partition");
+}
+
+static void
+FULLCONENAT_print(const void *ip, const struct xt_entry_target *target,
+                 int numeric)
+{
+	const struct nf_nat_ipv4_multi_range_compat *mr = (const void *)target->data;
+	struct nf_nat_range r;
+
+	range_from_compat(&r, &mr->range[0]);
+	FULLCONENAT_print_range(&r);
+}
+
+static void
+FULLCONENAT_save(const void *ip, const struct xt_entry_target *target)
+{
+	const struct nf_nat_ipv4_multi_range_compat *mr = (const void *)target->data;
+	struct nf_nat_range r;
+
+	range_from_compat(&r, &mr->range[0]);
+	FULLCONENAT_save_range(&r);
+}
+
+static void
+FULLCONENAT_print_v1(const void *ip, const struct xt_entry_target *target,
+                    int numeric)
+{
+	const struct xt_fullconenat_tginfo *info = (const void *)target->data;
+
+	FULLCONENAT_print_range(&info->range);
+
+	if (info->domain[0] != '\0')
+		printf(" domain %s", info->domain);
+
+	if (info->buckets != 0)
+		printf(" domain-buckets %u", info->buckets);
+}
+
+static void
+FULLCONENAT_save_v1(const void *ip, const struct xt_entry_target *target)
+{
+	const struct xt_fullconenat_tginfo *info = (const void *)target->data;
+
+	FULLCONENAT_save_range(&info->range);
+
+	if (info->domain[0] != '\0')
+		printf(" --domain %s", info->domain);
+
+	if (info->buckets != 0)
+		printf(" --domain-buckets %u", info->buckets);
 }
 
-static struct xtables_target fullconenat_tg_reg = {
-	.name		= "FULLCONENAT",
-	.version	= XTABLES_VERSION,
-	.family		= NFPROTO_IPV4,
-	.size		= XT_ALIGN(sizeof(struct nf_nat_ipv4_multi_range_compat)),
-	.userspacesize	= XT_ALIGN(sizeof(struct nf_nat_ipv4_multi_range_compat)),
-	.help		= FULLCONENAT_help,
-	.init		= FULLCONENAT_init,
-	.x6_parse	= FULLCONENAT_parse,
-	.print		= FULLCONENAT_print,
-	.save		= FULLCONENAT_save,
-	.x6_options	= FULLCONENAT_opts,
+static struct xtables_target fullconenat_tg_reg[] = {
+	{
+		.name		= "FULLCONENAT",
+		.version	= XTABLES_VERSION,
+		.family		= NFPROTO_IPV4,
+		.revision	= 0,
+		.size		= XT_ALIGN(sizeof(struct nf_nat_ipv4_multi_range_compat)),
+		.userspacesize	= XT_ALIGN(sizeof(struct nf_nat_ipv4_multi_range_compat)),
+		.help		= FULLCONENAT_help,
+		.init		= FULLCONENAT_init,
+		.x6_parse	= FULLCONENAT_parse,
+		.print		= FULLCONENAT_print,
+		.save		= FULLCONENAT_save,
+		.x6_options	= FULLCONENAT_opts,
+	},
+	{
+		.name		= "FULLCONENAT",
+		.version	= XTABLES_VERSION,
+		.family		= NFPROTO_IPV4,
+		.revision	= 1,
+		.size		= XT_ALIGN(sizeof(struct xt_fullconenat_tginfo)),
+		.userspacesize	= offsetof(struct xt_fullconenat_tginfo, d),
+		.help		= FULLCONENAT_help_v1,
+		.x6_parse	= FULLCONENAT_parse_v1,
+		.print		= FULLCONENAT_print_v1,
+		.save		= FULLCONENAT_save_v1,
+		.x6_options	= FULLCONENAT_opts_v1,
+	},
 };
 
 void _init(void)
 {
-	xtables_register_target(&fullconenat_tg_reg);
+	xtables_register_targets(fullconenat_tg_reg, ARRAY_SIZE(fullconenat_tg_reg));
 }
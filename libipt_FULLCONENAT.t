@@ -1,9 +1,26 @@
-:POSTROUTING
+:PREROUTING,POSTROUTING
 *nat
 -j FULLCONENAT;=;OK
 -j FULLCONENAT --random;=;OK
 -j FULLCONENAT --random-fully;=;OK
 -p tcp -j FULLCONENAT --to-ports 1024;=;OK
 -p udp -j FULLCONENAT --to-ports 1024-65535;=;OK
+-p udplite -j FULLCONENAT --to-ports 1024-65535;=;OK
+-p tcp -j FULLCONENAT --filter-mode address-port;=;OK
 -p udp -j FULLCONENAT --to-ports 1024-65536;;FAIL
 -p udp -j FULLCONENAT --to-ports -1;;FAIL
+-p udp -j FULLCONENAT --filter-mode address;=;OK
+-p udp -j FULLCONENAT --filter-mode address-port;=;OK
+-p udp -j FULLCONENAT --filter-mode endpoint;-p udp -j FULLCONENAT;OK
+-p udp -j FULLCONENAT --filter-mode port;;FAIL
+-p udp -j FULLCONENAT --to-ports 20000-60000 --cpu-partition;=;OK
+-p udp -j FULLCONENAT --domain wan1;=;OK
+-p udp -j FULLCONENAT --domain wan2 --domain-buckets 4096;=;OK
+-p udp -j FULLCONENAT --domain-buckets 4096;;FAIL
+-p udp -j FULLCONENAT --domain wan2 --domain-buckets 1000;;FAIL
+:PREROUTING
+-p udp -j FULLCONENAT --hairpin;=;OK
+-p udp -j FULLCONENAT --hairpin --to-ports 40000-60000;-p udp -j FULLCONENAT --to-ports 40000-60000 --hairpin;OK
+-p udp -j FULLCONENAT --hairpin --to-source 192.0.2.1;;FAIL
+:POSTROUTING
+-p udp -j FULLCONENAT --hairpin;;FAIL
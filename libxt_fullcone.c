@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+#include <xtables.h>
+#include <linux/netfilter/nf_nat.h>
+#include "xt_FULLCONENAT.h"
+
+enum {
+	O_MAPPED = 0,
+	O_DOMAIN,
+	O_ZONE,
+};
+
+static void fullcone_help(void)
+{
+	printf(
+"fullcone match options:\n"
+"[!] --mapped\n"
+"				Destination address and port are (not) those\n"
+"				of an existing FULLCONENAT mapping.\n"
+" --domain name\n"
+"				Look the mapping up in the named domain.\n"
+" --zone id\n"
+"				Conntrack zone of the mapping (default 0).\n");
+}
+
+static const struct xt_option_entry fullcone_opts[] = {
+	{.name = "mapped", .id = O_MAPPED, .type = XTTYPE_NONE,
+	 .flags = XTOPT_INVERT},
+	{.name = "domain", .id = O_DOMAIN, .type = XTTYPE_STRING,
+	 .min = 1, .max = XT_FULLCONENAT_DOMAIN_LEN - 1,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(struct xt_fullcone_mtinfo, domain)},
+	{.name = "zone", .id = O_ZONE, .type = XTTYPE_UINT16,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(struct xt_fullcone_mtinfo, zone)},
+	XTOPT_TABLEEND,
+};
+
+static void fullcone_parse(struct xt_option_call *cb)
+{
+	struct xt_fullcone_mtinfo *info = cb->data;
+
+	xtables_option_parse(cb);
+	if (cb->entry->id == O_MAPPED && cb->invert)
+		info->flags |= XT_FULLCONE_INVERT;
+}
+
+static void
+fullcone_print(const void *ip, const struct xt_entry_match *match,
+               int numeric)
+{
+	const struct xt_fullcone_mtinfo *info = (const void *)match->data;
+
+	printf(" fullcone%s mapped", (info->flags & XT_FULLCONE_INVERT) ? " not" : "");
+
+	if (info->domain[0] != '\0')
+		printf(" domain %s", info->domain);
+
+	if (info->zone != 0)
+		printf(" zone %hu", info->zone);
+}
+
+static void
+fullcone_save(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_fullcone_mtinfo *info = (const void *)match->data;
+
+	/* --mapped is the default, only the inverted form is saved */
+	if (info->flags & XT_FULLCONE_INVERT)
+		printf(" ! --mapped");
+
+	if (info->domain[0] != '\0')
+		printf(" --domain %s", info->domain);
+
+	if (info->zone != 0)
+		printf(" --zone %hu", info->zone);
+}
+
+static struct xtables_match fullcone_mt_reg = {
+	.name		= "fullcone",
+	.version	= XTABLES_VERSION,
+	.family		= NFPROTO_UNSPEC,
+	.revision	= 0,
+	.size		= XT_ALIGN(sizeof(struct xt_fullcone_mtinfo)),
+	.userspacesize	= offsetof(struct xt_fullcone_mtinfo, d),
+	.help		= fullcone_help,
+	.x6_parse	= fullcone_parse,
+	.print		= fullcone_print,
+	.save		= fullcone_save,
+	.x6_options	= fullcone_opts,
+};
+
+void _init(void)
+{
+	xtables_register_match(&fullcone_mt_reg);
+}
@@ -0,0 +1,9 @@
+:PREROUTING,OUTPUT
+*raw
+-p udp -m fullcone;=;OK
+-p udp -m fullcone ! --mapped;=;OK
+-p udp -m fullcone --mapped;-p udp -m fullcone;OK
+-p tcp -m fullcone ! --mapped --domain wan1;=;OK
+-p udp -m fullcone --zone 10;=;OK
+-p udp -m fullcone --zone 70000;;FAIL
+-p udp -m fullcone --domain wan1 ! --mapped;-p udp -m fullcone ! --mapped --domain wan1;OK
@@ -12,15 +12,34 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/hashtable.h>
+#include <linux/jhash.h>
 #include <linux/netdevice.h>
 #include <linux/inetdevice.h>
 #include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include <linux/bpf.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/cpuhotplug.h>
+#include <linux/bitmap.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/clock.h>
+#endif
 #ifdef CONFIG_NF_CONNTRACK_CHAIN_EVENTS
 #include <linux/notifier.h>
 #endif
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
 #include <linux/netfilter/x_tables.h>
+#include <linux/rcupdate.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/addrconf.h>
 #include <net/netfilter/nf_nat.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_zones.h>
@@ -28,14 +47,59 @@
 #include <net/netfilter/nf_conntrack_core.h>
 #include <net/netfilter/nf_conntrack_ecache.h>
 
+#include "xt_FULLCONENAT.h"
+
 #define HASH_2(x, y) ((x + y) / 2 * (x + y + 1) + y)
 
+/* mappings of different conntrack zones never collide: tenants may
+ * reuse both internal addresses and external ports. */
+#define HASH_EXT_PORT(port, zone_id) ((u32)(port) | ((u32)(zone_id) << 16))
+#define HASH_INT_SRC(addr, port, zone_id) (HASH_2(addr_fold(addr), (u32)(port)) ^ (u32)(zone_id))
+
+#define DOMAIN_BUCKET(domain, table, protonum, key) (&(domain)->table[proto_index(protonum)][hash_32((key), (domain)->bits)])
+
 #define HASHTABLE_BUCKET_BITS 10
 
+/* teardown of a domain: mappings per work item at least, and mappings
+ * freed between two chances to reschedule */
+#define TEARDOWN_MIN_SLICE 16384
+#define TEARDOWN_BATCH 256
+
+/* dying conntracks handled per domain lock hold in the GC */
+#define GC_BATCH 256
+
+/* buckets and locks of tuple_owners, and the domains remembered per
+ * dying conntrack before the GC falls back to asking all of them */
+#define TUPLE_OWNER_BITS 14
+#define TUPLE_OWNER_LOCK_BITS 8
+#define TUPLE_OWNERS_MAX 2
+
+/* bounds for the table size of a named domain, per protocol and table */
+#define DOMAIN_MIN_BUCKETS 16
+#define DOMAIN_MAX_BUCKETS (1 << 20)
+
+/* protocols with endpoint-independent mappings, one pair of tables each */
+enum {
+  FULLCONENAT_PROTO_UDP = 0,
+  FULLCONENAT_PROTO_TCP,
+  FULLCONENAT_PROTO_UDPLITE,
+  FULLCONENAT_PROTO_MAX,
+};
+
+#define PEER_SET_MIN_SIZE 8
+
+#define PEER_SLOT_EMPTY 0
+#define PEER_SLOT_DELETED UINT_MAX
+
 #ifndef NF_NAT_RANGE_PROTO_RANDOM_FULLY
 #define NF_NAT_RANGE_PROTO_RANDOM_FULLY (1 << 4)
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+/* struct nf_nat_range was renamed to nf_nat_range2 when base_proto was added */
+#define nf_nat_range2 nf_nat_range
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
 
 static inline int nf_ct_netns_get(struct net *net, u8 nfproto) { return 0; }
@@ -54,34 +118,111 @@ static inline unsigned int xt_hooknum(const struct xt_action_param *par) {
   return par->hooknum;
 }
 
+static inline u_int8_t xt_family(const struct xt_action_param *par) {
+  return par->family;
+}
+
 #endif
 
 struct nat_mapping_original_tuple {
   struct nf_conntrack_tuple tuple;
+  int peer_counted;  /* whether tuple.dst is accounted in the peer set */
+  u32 domain_id;     /* id of the domain of the mapping holding this */
 
   struct list_head node;
+  struct hlist_node node_by_tuple; /* in tuple_owners */
+};
+
+struct nat_mapping_peer {
+  union nf_inet_addr addr;
+  __be16 port;
+  unsigned int count; /* PEER_SLOT_EMPTY, PEER_SLOT_DELETED or number of tuples */
+};
+
+/* open-addressed (linear probing) set of the remote endpoints an internal
+ * source has sent to, used for address(-and-port)-dependent filtering. */
+struct nat_mapping_peer_set {
+  unsigned int size;   /* number of slots, power of 2 */
+  unsigned int used;   /* live slots */
+  unsigned int filled; /* live and deleted slots */
+  struct nat_mapping_peer slots[];
+};
+
+/* a set of mapping tables with its own lock, port pool and counters.
+ * revision 1 rules naming the same domain share it, all other rules
+ * use default_domain. */
+struct fullconenat_domain {
+  struct list_head list;  /* in domain_list */
+  char name[XT_FULLCONENAT_DOMAIN_LEN];
+  int refer_count;        /* rules using this domain, under domain_list_lock */
+  u32 id;                 /* unique for the module lifetime, see tuple_owners */
+
+  spinlock_t lock;
+  u64 lock_acquired;      /* local_clock() when lock was taken, 0 if not measured */
+  unsigned int bits;      /* log2 of the number of buckets per table */
+  /* indexed by FULLCONENAT_PROTO_*, see proto_index() */
+  struct hlist_head *by_ext_port[FULLCONENAT_PROTO_MAX];
+  struct hlist_head *by_int_src[FULLCONENAT_PROTO_MAX];
+
+  /* next port offset to try in each CPU's slice of a partitioned range */
+  uint16_t __percpu *port_slice_cursor;
+  /* one bit per port, per FULLCONENAT_PROTO_*: held by a mapping of a
+   * --cpu-partition rule, under lock. */
+  unsigned long *port_claims[FULLCONENAT_PROTO_MAX];
+
+  /* counters, under lock */
+  unsigned int mappings;
+  u64 allocated;
+  u64 killed;
+  u64 exhausted;          /* port searches that had to override a live mapping */
+
+  /* per FULLCONENAT_PROTO_*: range and flags of the POSTROUTING rule that
+   * last mapped a flow of that protocol in this domain, and its netns,
+   * only compared, never dereferenced. under lock. hairpin mappings of a
+   * --hairpin rule without --to-ports are allocated from it as well. */
+  struct nf_nat_range2 snat_range[FULLCONENAT_PROTO_MAX];
+  const struct net *snat_range_net[FULLCONENAT_PROTO_MAX];
 };
 
 struct nat_mapping {
-  uint16_t port;     /* external UDP port */
+  uint8_t family;    /* NFPROTO_IPV4 or NFPROTO_IPV6 */
+  uint8_t protonum;  /* IPPROTO_UDP, IPPROTO_TCP or IPPROTO_UDPLITE */
+
+  uint16_t port;     /* external port */
   int ifindex;       /* external interface index*/
+  union nf_inet_addr ext_addr; /* external ip address */
 
-  __be32 int_addr;   /* internal source ip address */
+  union nf_inet_addr int_addr; /* internal source ip address */
   uint16_t int_port; /* internal source port */
 
+  struct nf_conntrack_zone zone; /* conntrack zone of the internal source */
+
+  struct fullconenat_domain *domain; /* the tables this mapping lives in */
+
   int refer_count;   /* how many references linked to this mapping
                       * aka. length of original_tuple_list */
 
+  unsigned int filter_mode;              /* XT_FULLCONENAT_FILTER_* */
+  int port_claimed;                      /* holds the bit of port in domain->port_claims */
+  int init_net;                          /* created in init_net, see mapping_mirrored() */
+  struct nat_mapping_peer_set *peer_set; /* NULL for endpoint-independent filtering */
+
   struct list_head original_tuple_list;
 
+  /* added and removed under the domain lock. node_by_ext_port is also
+   * walked locklessly by the fullcone match, hence the RCU freeing. */
   struct hlist_node node_by_ext_port;
   struct hlist_node node_by_int_src;
 
+  struct rcu_head rcu;
 };
 
 struct tuple_list {
   struct nf_conntrack_tuple tuple_original;
   struct nf_conntrack_tuple tuple_reply;
+  struct nf_conntrack_zone zone;
+  u32 owners[TUPLE_OWNERS_MAX]; /* ids of the domains referencing it */
+  int nr_owners;                /* -1 if there were more than TUPLE_OWNERS_MAX */
   struct list_head list;
 };
 
@@ -95,27 +236,590 @@ int ct_event_notifier_registered = 0;
 
 static DEFINE_MUTEX(nf_ct_net_event_lock);
 
-static DEFINE_HASHTABLE(mapping_table_by_ext_port, HASHTABLE_BUCKET_BITS);
-static DEFINE_HASHTABLE(mapping_table_by_int_src, HASHTABLE_BUCKET_BITS);
+static LIST_HEAD(domain_list);
+static DEFINE_MUTEX(domain_list_lock);
+static struct fullconenat_domain *default_domain = NULL;
+static u32 domain_next_id = 1; /* under domain_list_lock */
 
-static DEFINE_SPINLOCK(fullconenat_lock);
+static u32 peer_set_seed __read_mostly;
+
+/* every nat_mapping_original_tuple, hashed by its tuple. a conntrack does
+ * not tell which rule NATed it, so this is how the GC finds the domains
+ * whose mappings reference a dying conntrack. */
+static struct hlist_head tuple_owners[1 << TUPLE_OWNER_BITS];
+static spinlock_t tuple_owner_locks[1 << TUPLE_OWNER_LOCK_BITS];
+static u32 tuple_owner_seed __read_mostly;
 
 static LIST_HEAD(dying_tuple_list);
 static DEFINE_SPINLOCK(dying_tuple_list_lock);
 static void gc_worker(struct work_struct *work);
 static struct workqueue_struct *wq __read_mostly = NULL;
+static struct workqueue_struct *teardown_wq __read_mostly = NULL;
+
+/* --cpu-partition slices: online CPUs numbered 0 .. nr_port_slices - 1 */
+static DEFINE_PER_CPU(unsigned int, port_slice_index);
+static unsigned int nr_port_slices __read_mostly = 1;
+static int port_slices_hp_state = -1;
 static DECLARE_DELAYED_WORK(gc_worker_wk, gc_worker);
 
+static bool log_mappings = false;
+module_param(log_mappings, bool, 0444);
+MODULE_PARM_DESC(log_mappings, "export mapping allocations and removals to the binary mapping log");
+
+static unsigned int log_subbuf_size = 256 * 1024;
+module_param(log_subbuf_size, uint, 0444);
+MODULE_PARM_DESC(log_subbuf_size, "size of each mapping log sub-buffer in bytes");
+
+static unsigned int log_n_subbufs = 8;
+module_param(log_n_subbufs, uint, 0444);
+MODULE_PARM_DESC(log_n_subbufs, "number of mapping log sub-buffers per CPU");
+
+static struct dentry *debugfs_root = NULL;
+static struct rchan *log_chan = NULL;
+static DEFINE_PER_CPU(u64, log_dropped);
+
 static char tuple_tmp_string[512];
 /* non-atomic: can only be called serially within lock zones. */
 static char* nf_ct_stringify_tuple(const struct nf_conntrack_tuple *t) {
-  snprintf(tuple_tmp_string, sizeof(tuple_tmp_string), "%pI4:%hu -> %pI4:%hu",
-         &t->src.u3.ip, be16_to_cpu(t->src.u.all),
-         &t->dst.u3.ip, be16_to_cpu(t->dst.u.all));
+  if (t->src.l3num == NFPROTO_IPV6) {
+    snprintf(tuple_tmp_string, sizeof(tuple_tmp_string), "[%pI6c]:%hu -> [%pI6c]:%hu",
+           &t->src.u3.in6, be16_to_cpu(t->src.u.all),
+           &t->dst.u3.in6, be16_to_cpu(t->dst.u.all));
+  } else {
+    snprintf(tuple_tmp_string, sizeof(tuple_tmp_string), "%pI4:%hu -> %pI4:%hu",
+           &t->src.u3.ip, be16_to_cpu(t->src.u.all),
+           &t->dst.u3.ip, be16_to_cpu(t->dst.u.all));
+  }
   return tuple_tmp_string;
 }
 
-static struct nat_mapping* allocate_mapping(const __be32 int_addr, const uint16_t int_port, const uint16_t port, const int ifindex) {
+/* the mapping tables of a L4 protocol, or -1 if it gets plain MASQUERADE treatment. */
+static inline int proto_index(const uint8_t protonum) {
+  switch (protonum) {
+  case IPPROTO_UDP:
+    return FULLCONENAT_PROTO_UDP;
+  case IPPROTO_TCP:
+    return FULLCONENAT_PROTO_TCP;
+  case IPPROTO_UDPLITE:
+    return FULLCONENAT_PROTO_UDPLITE;
+  default:
+    return -1;
+  }
+}
+
+/* IPv4 addresses only use the first word, the rest of the union is zero. */
+static inline u32 addr_fold(const union nf_inet_addr *addr) {
+  return (__force u32)(addr->all[0] ^ addr->all[1] ^ addr->all[2] ^ addr->all[3]);
+}
+
+static inline int addr_is_zero(const union nf_inet_addr *addr) {
+  return (addr->all[0] | addr->all[1] | addr->all[2] | addr->all[3]) == 0;
+}
+
+static struct dentry *log_create_buf_file(const char *filename, struct dentry *parent, umode_t mode, struct rchan_buf *buf, int *is_global) {
+  return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int log_remove_buf_file(struct dentry *dentry) {
+  debugfs_remove(dentry);
+  return 0;
+}
+
+/* the default sub-buffer switch callback never overwrites unread data,
+ * records that don't fit are dropped and counted instead. */
+static struct rchan_callbacks log_relay_callbacks = {
+  .create_buf_file = log_create_buf_file,
+  .remove_buf_file = log_remove_buf_file,
+};
+
+static int log_dropped_get(void *data, u64 *val) {
+  int cpu;
+
+  *val = 0;
+  for_each_possible_cpu(cpu) {
+    *val += per_cpu(log_dropped, cpu);
+  }
+  return 0;
+}
+
+static int log_dropped_set(void *data, u64 val) {
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    per_cpu(log_dropped, cpu) = 0;
+  }
+  return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(log_dropped_fops, log_dropped_get, log_dropped_set, "%llu\n");
+
+/* latency statistics: per-CPU log2 histograms, off unless switched on
+ * through debugfs. bucket 0 counts zero values, bucket i > 0 counts
+ * values in [2^(i-1), 2^i), the last bucket everything above. */
+enum {
+  STATS_LOCK_WAIT = 0,  /* ns spent waiting for a domain lock */
+  STATS_LOCK_HOLD,      /* ns a domain lock was held */
+  STATS_PORT_PROBES,    /* ports looked at by one find_appropriate_port() */
+  STATS_TG_TIME,        /* ns spent in fullconenat_tg() */
+  STATS_GC_BATCH,       /* ns handle_dying_tuples() took for one batch */
+  STATS_MAX,
+};
+
+#define STATS_BUCKETS 32
+
+static const char * const stats_names[STATS_MAX] = {
+  [STATS_LOCK_WAIT]   = "lock_wait_ns",
+  [STATS_LOCK_HOLD]   = "lock_hold_ns",
+  [STATS_PORT_PROBES] = "port_probes",
+  [STATS_TG_TIME]     = "tg_ns",
+  [STATS_GC_BATCH]    = "gc_batch_ns",
+};
+
+struct fullconenat_stats {
+  u64 hist[STATS_MAX][STATS_BUCKETS];
+};
+
+static DEFINE_STATIC_KEY_FALSE(stats_enabled);
+static DEFINE_PER_CPU(struct fullconenat_stats, stats);
+
+static inline void stats_record(const int which, const u64 value) {
+  unsigned int bucket = value == 0 ? 0 : min_t(unsigned int, fls64(value), STATS_BUCKETS - 1);
+
+  this_cpu_inc(stats.hist[which][bucket]);
+}
+
+/* all users of a domain lock go through these two, so that wait and
+ * hold times are measured once statistics are enabled. */
+static inline void domain_lock(struct fullconenat_domain *domain) {
+  u64 start;
+
+  if (!static_branch_unlikely(&stats_enabled)) {
+    spin_lock_bh(&domain->lock);
+    domain->lock_acquired = 0;
+    return;
+  }
+
+  start = local_clock();
+  spin_lock_bh(&domain->lock);
+  domain->lock_acquired = local_clock();
+  stats_record(STATS_LOCK_WAIT, domain->lock_acquired - start);
+}
+
+static inline void domain_unlock(struct fullconenat_domain *domain) {
+  /* the key may have been flipped while the lock was held */
+  if (static_branch_unlikely(&stats_enabled) && domain->lock_acquired != 0) {
+    stats_record(STATS_LOCK_HOLD, local_clock() - domain->lock_acquired);
+  }
+  spin_unlock_bh(&domain->lock);
+}
+
+static int stats_enabled_get(void *data, u64 *val) {
+  *val = static_key_enabled(&stats_enabled);
+  return 0;
+}
+
+static int stats_enabled_set(void *data, u64 val) {
+  if (val) {
+    static_branch_enable(&stats_enabled);
+  } else {
+    static_branch_disable(&stats_enabled);
+  }
+  return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(stats_enabled_fops, stats_enabled_get, stats_enabled_set, "%llu\n");
+
+static int stats_show(struct seq_file *s, void *unused) {
+  u64 hist[STATS_BUCKETS], total, lo;
+  int which, cpu, i, first, last;
+
+  for (which = 0; which < STATS_MAX; which++) {
+    memset(hist, 0, sizeof(hist));
+    for_each_possible_cpu(cpu) {
+      for (i = 0; i < STATS_BUCKETS; i++) {
+        hist[i] += per_cpu(stats, cpu).hist[which][i];
+      }
+    }
+
+    total = 0;
+    first = -1;
+    last = -1;
+    for (i = 0; i < STATS_BUCKETS; i++) {
+      if (hist[i] != 0) {
+        if (first < 0) {
+          first = i;
+        }
+        last = i;
+        total += hist[i];
+      }
+    }
+
+    seq_printf(s, "%s: %llu samples\n", stats_names[which], total);
+    for (i = first; first >= 0 && i <= last; i++) {
+      lo = i == 0 ? 0 : 1ULL << (i - 1);
+      if (i == STATS_BUCKETS - 1) {
+        seq_printf(s, "  [%llu, inf) %llu\n", lo, hist[i]);
+      } else {
+        seq_printf(s, "  [%llu, %llu) %llu\n", lo, 1ULL << i, hist[i]);
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file) {
+  return single_open(file, stats_show, NULL);
+}
+
+/* any write resets all histograms. counts of packets being processed
+ * meanwhile may survive the reset, like with mapping_log_dropped. */
+static ssize_t stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    memset(per_cpu_ptr(&stats, cpu), 0, sizeof(struct fullconenat_stats));
+  }
+  return count;
+}
+
+static const struct file_operations stats_fops = {
+  .owner = THIS_MODULE,
+  .open = stats_open,
+  .read = seq_read,
+  .write = stats_write,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+/* called with a domain lock held or, during teardown, at least with bh
+ * disabled on this CPU, which is all the serialization relay_reserve()
+ * needs. */
+static void log_mapping_event(const struct nat_mapping *mapping, const uint8_t event) {
+  struct xt_fullconenat_log_record *record;
+
+  if (log_chan == NULL) {
+    return;
+  }
+
+  record = relay_reserve(log_chan, sizeof(struct xt_fullconenat_log_record));
+  if (record == NULL) {
+    this_cpu_inc(log_dropped);
+    return;
+  }
+
+  memset(record, 0, sizeof(struct xt_fullconenat_log_record));
+  record->timestamp_ns = ktime_get_real_ns();
+  record->event = event;
+  record->family = (mapping->family == NFPROTO_IPV6) ? AF_INET6 : AF_INET;
+  record->zone = mapping->zone.id;
+  record->ifindex = mapping->ifindex;
+  memcpy(record->int_addr, &mapping->int_addr, sizeof(record->int_addr));
+  memcpy(record->ext_addr, &mapping->ext_addr, sizeof(record->ext_addr));
+  record->int_port = cpu_to_be16(mapping->int_port);
+  record->ext_port = cpu_to_be16(mapping->port);
+  record->l4proto = mapping->protonum;
+}
+
+#if IS_ENABLED(CONFIG_BPF_SYSCALL)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 7, 0)
+static inline void bpf_disable_instrumentation(void) {
+  preempt_disable();
+  __this_cpu_inc(bpf_prog_active);
+}
+
+static inline void bpf_enable_instrumentation(void) {
+  __this_cpu_dec(bpf_prog_active);
+  preempt_enable();
+}
+#endif
+
+/* fast path mappings mirrored per domain lock section when the map is handed over */
+#define FASTPATH_FILL_BATCH 256
+
+/* BPF hash map mirroring the mappings for the tc fast path, see bpf_map_fd
+ * in debugfs. read under RCU, replaced under domain_list_lock. */
+static struct bpf_map __rcu *fastpath_map = NULL;
+
+/* only mappings the fast path can serve without conntrack are mirrored:
+ * IPv4 UDP in the default zone with endpoint-independent filtering. the
+ * map is global and keyed by ifindex, which are only unique per netns,
+ * so only the initial netns is mirrored. */
+static int mapping_mirrored(const struct nat_mapping *mapping) {
+  return mapping->init_net
+    && mapping->family == NFPROTO_IPV4 && mapping->protonum == IPPROTO_UDP
+    && mapping->zone.id == NF_CT_DEFAULT_ZONE_ID
+    && !(mapping->filter_mode & XT_FULLCONENAT_FILTER_MASK);
+}
+
+static void fastpath_key(const struct nat_mapping *mapping, struct xt_fullconenat_bpf_key *key) {
+  memset(key, 0, sizeof(struct xt_fullconenat_bpf_key));
+  key->ext_addr = mapping->ext_addr.ip;
+  key->ext_port = cpu_to_be16(mapping->port);
+  key->l4proto = mapping->protonum;
+}
+
+/* called with the domain lock of the mapping held */
+static void fastpath_update(const struct nat_mapping *mapping) {
+  struct xt_fullconenat_bpf_key key;
+  struct xt_fullconenat_bpf_value value;
+  struct bpf_map *map;
+  int err = 0;
+
+  if (!mapping_mirrored(mapping)) {
+    return;
+  }
+
+  fastpath_key(mapping, &key);
+  memset(&value, 0, sizeof(value));
+  value.int_addr = mapping->int_addr.ip;
+  value.int_port = cpu_to_be16(mapping->int_port);
+  value.ifindex = mapping->ifindex;
+
+  /* like bpf_map_update_value(): keep tracing programs on this CPU from
+   * entering the map while we hold its bucket lock. */
+  bpf_disable_instrumentation();
+  rcu_read_lock();
+  map = rcu_dereference(fastpath_map);
+  if (map != NULL) {
+    err = map->ops->map_update_elem(map, &key, &value, BPF_ANY);
+  }
+  rcu_read_unlock();
+  bpf_enable_instrumentation();
+
+  if (err) {
+    /* the mapping keeps working through the slow path */
+    pr_debug("xt_FULLCONENAT: fastpath_update(): map update for ext port %d failed: %d\n", mapping->port, err);
+  }
+}
+
+/* called with the domain lock of the mapping held, or from its teardown */
+static void fastpath_delete(const struct nat_mapping *mapping) {
+  struct xt_fullconenat_bpf_key key;
+  struct bpf_map *map;
+
+  if (!mapping_mirrored(mapping)) {
+    return;
+  }
+
+  fastpath_key(mapping, &key);
+
+  bpf_disable_instrumentation();
+  rcu_read_lock();
+  map = rcu_dereference(fastpath_map);
+  if (map != NULL) {
+    map->ops->map_delete_elem(map, &key);
+  }
+  rcu_read_unlock();
+  bpf_enable_instrumentation();
+}
+
+/* the loader writes the fd of its map here, or -1 to detach. the map
+ * is filled with the existing mappings right away. */
+static ssize_t fastpath_map_fd_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+  struct bpf_map *map = NULL, *old_map;
+  struct fullconenat_domain *domain;
+  struct nat_mapping *p_current;
+  unsigned int batch;
+  int fd, ret, i;
+
+  ret = kstrtoint_from_user(buf, count, 10, &fd);
+  if (ret) {
+    return ret;
+  }
+
+  if (fd >= 0) {
+    map = bpf_map_get(fd);
+    if (IS_ERR(map)) {
+      return PTR_ERR(map);
+    }
+    if (map->map_type != BPF_MAP_TYPE_HASH
+      || map->key_size != sizeof(struct xt_fullconenat_bpf_key)
+      || map->value_size != sizeof(struct xt_fullconenat_bpf_value)) {
+      bpf_map_put(map);
+      return -EINVAL;
+    }
+  }
+
+  mutex_lock(&domain_list_lock);
+
+  old_map = rcu_dereference_protected(fastpath_map, lockdep_is_held(&domain_list_lock));
+  rcu_assign_pointer(fastpath_map, map);
+
+  if (map != NULL) {
+    list_for_each_entry(domain, &domain_list, list) {
+      batch = 0;
+      domain_lock(domain);
+      for (i = 0; i < (1 << domain->bits); i++) {
+        hlist_for_each_entry(p_current, &domain->by_ext_port[FULLCONENAT_PROTO_UDP][i], node_by_ext_port) {
+          fastpath_update(p_current);
+          batch++;
+        }
+
+        /* the map is published already, mappings allocated while the
+         * lock is dropped are mirrored by allocate_mapping() itself. */
+        if (batch >= FASTPATH_FILL_BATCH) {
+          batch = 0;
+          domain_unlock(domain);
+          cond_resched();
+          domain_lock(domain);
+        }
+      }
+      domain_unlock(domain);
+    }
+  }
+
+  mutex_unlock(&domain_list_lock);
+
+  if (old_map != NULL) {
+    synchronize_rcu();
+    bpf_map_put(old_map);
+  }
+
+  return count;
+}
+
+static const struct file_operations fastpath_map_fd_fops = {
+  .owner = THIS_MODULE,
+  .open = simple_open,
+  .write = fastpath_map_fd_write,
+  .llseek = noop_llseek,
+};
+
+/* on module exit, once no mapping is left to update the map. */
+static void fastpath_release(void) {
+  struct bpf_map *map = rcu_dereference_protected(fastpath_map, 1);
+
+  if (map != NULL) {
+    RCU_INIT_POINTER(fastpath_map, NULL);
+    synchronize_rcu();
+    bpf_map_put(map);
+  }
+}
+#else
+static inline void fastpath_update(const struct nat_mapping *mapping) {}
+static inline void fastpath_delete(const struct nat_mapping *mapping) {}
+static inline void fastpath_release(void) {}
+#endif
+
+static struct nat_mapping_peer* peer_set_find_slot(struct nat_mapping_peer_set *set, const union nf_inet_addr *addr, const __be16 port, const int for_insert) {
+  struct nat_mapping_peer *slot, *deleted = NULL;
+  unsigned int i, mask = set->size - 1;
+
+  for (i = jhash2((const u32 *)addr->all, ARRAY_SIZE(addr->all), peer_set_seed ^ (__force u32)port) & mask; ; i = (i + 1) & mask) {
+    slot = &set->slots[i];
+    if (slot->count == PEER_SLOT_EMPTY) {
+      /* end of the probe chain: reuse an earlier deleted slot if we can */
+      return for_insert ? (deleted ? deleted : slot) : NULL;
+    }
+    if (slot->count == PEER_SLOT_DELETED) {
+      if (deleted == NULL)
+        deleted = slot;
+    } else if (nf_inet_addr_cmp(&slot->addr, addr) && slot->port == port) {
+      return slot;
+    }
+  }
+}
+
+/* the set is never full (load factor <= 3/4), so probing always terminates. */
+static int peer_set_grow(struct nat_mapping *mapping) {
+  struct nat_mapping_peer_set *old_set = mapping->peer_set, *new_set;
+  struct nat_mapping_peer *slot;
+  unsigned int size = PEER_SET_MIN_SIZE, used = 0, i;
+
+  if (old_set != NULL) {
+    used = old_set->used;
+    if ((old_set->filled + 1) * 4 <= old_set->size * 3) {
+      return 0;
+    }
+  }
+  while ((used + 1) * 2 > size) {
+    size <<= 1;
+  }
+
+  new_set = kzalloc(struct_size(new_set, slots, size), GFP_ATOMIC);
+  if (new_set == NULL) {
+    pr_debug("xt_FULLCONENAT: ERROR: kzalloc() for nat_mapping_peer_set failed.\n");
+    return -ENOMEM;
+  }
+  new_set->size = size;
+
+  if (old_set != NULL) {
+    for (i = 0; i < old_set->size; i++) {
+      if (old_set->slots[i].count == PEER_SLOT_EMPTY || old_set->slots[i].count == PEER_SLOT_DELETED)
+        continue;
+      slot = peer_set_find_slot(new_set, &old_set->slots[i].addr, old_set->slots[i].port, 1);
+      *slot = old_set->slots[i];
+    }
+    kfree(old_set);
+  }
+  new_set->used = new_set->filled = used;
+  mapping->peer_set = new_set;
+
+  return 0;
+}
+
+/* the filtering key of a remote endpoint: the port is ignored for address-dependent filtering. */
+static __be16 peer_key_port(const struct nat_mapping *mapping, const __be16 port) {
+  return (mapping->filter_mode & XT_FULLCONENAT_FILTER_ADDR_PORT) ? port : 0;
+}
+
+static int peer_set_add(struct nat_mapping *mapping, const union nf_inet_addr *addr, const __be16 port) {
+  struct nat_mapping_peer *slot;
+  __be16 key_port = peer_key_port(mapping, port);
+
+  if (mapping->peer_set != NULL) {
+    slot = peer_set_find_slot(mapping->peer_set, addr, key_port, 0);
+    if (slot != NULL) {
+      slot->count++;
+      return 0;
+    }
+  }
+
+  if (peer_set_grow(mapping) != 0) {
+    return -ENOMEM;
+  }
+
+  slot = peer_set_find_slot(mapping->peer_set, addr, key_port, 1);
+  if (slot->count == PEER_SLOT_EMPTY) {
+    mapping->peer_set->filled++;
+  }
+  slot->addr = *addr;
+  slot->port = key_port;
+  slot->count = 1;
+  mapping->peer_set->used++;
+
+  return 0;
+}
+
+static void peer_set_del(struct nat_mapping *mapping, const union nf_inet_addr *addr, const __be16 port) {
+  struct nat_mapping_peer *slot;
+
+  if (mapping->peer_set == NULL) {
+    return;
+  }
+  slot = peer_set_find_slot(mapping->peer_set, addr, peer_key_port(mapping, port), 0);
+  if (slot == NULL) {
+    return;
+  }
+  if (--(slot->count) == 0) {
+    slot->count = PEER_SLOT_DELETED;
+    mapping->peer_set->used--;
+  }
+}
+
+/* RFC 4787 inbound filtering: may the remote endpoint addr:port reach this mapping? */
+static int mapping_allows_peer(const struct nat_mapping *mapping, const union nf_inet_addr *addr, const __be16 port) {
+  if (!(mapping->filter_mode & XT_FULLCONENAT_FILTER_MASK)) {
+    return 1;
+  }
+  if (mapping->peer_set == NULL) {
+    return 0;
+  }
+  return peer_set_find_slot(mapping->peer_set, addr, peer_key_port(mapping, port), 0) != NULL;
+}
+
+static struct nat_mapping* allocate_mapping(struct fullconenat_domain *domain, const struct net *net, const uint8_t family, const uint8_t protonum, const struct nf_conntrack_zone *zone, const union nf_inet_addr *int_addr, const uint16_t int_port, const union nf_inet_addr *ext_addr, const uint16_t port, const int ifindex, const unsigned int filter_mode) {
   struct nat_mapping *p_new;
   u32 hash_src;
 
@@ -124,41 +828,149 @@ static struct nat_mapping* allocate_mapping(const __be32 int_addr, const uint16_
     pr_debug("xt_FULLCONENAT: ERROR: kmalloc() for new nat_mapping failed.\n");
     return NULL;
   }
+  p_new->family = family;
+  p_new->protonum = protonum;
   p_new->port = port;
-  p_new->int_addr = int_addr;
+  p_new->ext_addr = *ext_addr;
+  p_new->int_addr = *int_addr;
   p_new->int_port = int_port;
+  p_new->zone = *zone;
+  p_new->domain = domain;
   p_new->ifindex = ifindex;
   p_new->refer_count = 0;
+  p_new->filter_mode = filter_mode;
+  p_new->peer_set = NULL;
+  p_new->port_claimed = 0;
+  p_new->init_net = net_eq(net, &init_net);
   (p_new->original_tuple_list).next = &(p_new->original_tuple_list);
   (p_new->original_tuple_list).prev = &(p_new->original_tuple_list);
 
-  hash_src = HASH_2(int_addr, (u32)int_port);
+  hash_src = HASH_INT_SRC(int_addr, int_port, zone->id);
+
+  hlist_add_head_rcu(&p_new->node_by_ext_port, DOMAIN_BUCKET(domain, by_ext_port, protonum, HASH_EXT_PORT(port, zone->id)));
+  hlist_add_head_rcu(&p_new->node_by_int_src, DOMAIN_BUCKET(domain, by_int_src, protonum, hash_src));
 
-  hash_add(mapping_table_by_ext_port, &p_new->node_by_ext_port, port);
-  hash_add(mapping_table_by_int_src, &p_new->node_by_int_src, hash_src);
+  domain->mappings++;
+  domain->allocated++;
+
+  if (family == NFPROTO_IPV6) {
+    pr_debug("xt_FULLCONENAT: new mapping allocated for [%pI6c]:%d ==> %d\n",
+      &p_new->int_addr.in6, p_new->int_port, p_new->port);
+  } else {
+    pr_debug("xt_FULLCONENAT: new mapping allocated for %pI4:%d ==> %d\n", 
+      &p_new->int_addr.ip, p_new->int_port, p_new->port);
+  }
 
-  pr_debug("xt_FULLCONENAT: new mapping allocated for %pI4:%d ==> %d\n", 
-    &p_new->int_addr, p_new->int_port, p_new->port);
+  log_mapping_event(p_new, XT_FULLCONENAT_LOG_ALLOCATE);
+  fastpath_update(p_new);
 
   return p_new;
 }
 
-static void add_original_tuple_to_mapping(struct nat_mapping *mapping, const struct nf_conntrack_tuple* original_tuple) {
+static u32 tuple_owner_hash(const struct nf_conntrack_tuple *tuple) {
+  u32 hash;
+
+  hash = jhash_3words((__force u32)(tuple->src).u.all, (__force u32)(tuple->dst).u.all, (tuple->dst).protonum, tuple_owner_seed);
+  hash = jhash2((const u32 *)(tuple->src).u3.all, ARRAY_SIZE((tuple->src).u3.all), hash);
+  hash = jhash2((const u32 *)(tuple->dst).u3.all, ARRAY_SIZE((tuple->dst).u3.all), hash);
+
+  return hash_32(hash, TUPLE_OWNER_BITS);
+}
+
+static inline spinlock_t *tuple_owner_lock(const u32 hash) {
+  return &tuple_owner_locks[hash & ((1 << TUPLE_OWNER_LOCK_BITS) - 1)];
+}
+
+/* callers have bh disabled */
+static void tuple_owner_link(struct nat_mapping_original_tuple *item) {
+  u32 hash = tuple_owner_hash(&item->tuple);
+
+  spin_lock(tuple_owner_lock(hash));
+  hlist_add_head(&item->node_by_tuple, &tuple_owners[hash]);
+  spin_unlock(tuple_owner_lock(hash));
+}
+
+static void tuple_owner_unlink(struct nat_mapping_original_tuple *item) {
+  u32 hash = tuple_owner_hash(&item->tuple);
+
+  spin_lock(tuple_owner_lock(hash));
+  hlist_del(&item->node_by_tuple);
+  spin_unlock(tuple_owner_lock(hash));
+}
+
+/* fill in the domains referencing a dying conntrack */
+static void tuple_owners_lookup(struct tuple_list *dying) {
+  struct nat_mapping_original_tuple *item;
+  u32 hash = tuple_owner_hash(&dying->tuple_original);
+  int i;
+
+  dying->nr_owners = 0;
+
+  spin_lock_bh(tuple_owner_lock(hash));
+  hlist_for_each_entry(item, &tuple_owners[hash], node_by_tuple) {
+    if (!nf_ct_tuple_equal(&item->tuple, &dying->tuple_original)) {
+      continue;
+    }
+    for (i = 0; i < dying->nr_owners && dying->owners[i] != item->domain_id; i++);
+    if (i < dying->nr_owners) {
+      continue;
+    }
+    if (dying->nr_owners == TUPLE_OWNERS_MAX) {
+      dying->nr_owners = -1;
+      break;
+    }
+    dying->owners[dying->nr_owners++] = item->domain_id;
+  }
+  spin_unlock_bh(tuple_owner_lock(hash));
+}
+
+static int tuple_owned_by(const struct tuple_list *dying, const struct fullconenat_domain *domain) {
+  int i;
+
+  if (dying->nr_owners < 0) {
+    return 1;
+  }
+  for (i = 0; i < dying->nr_owners; i++) {
+    if (dying->owners[i] == domain->id) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* outbound tuples also record their destination in the peer set of a filtering mapping. */
+static void add_original_tuple_to_mapping(struct nat_mapping *mapping, const struct nf_conntrack_tuple* original_tuple, const int outbound) {
   struct nat_mapping_original_tuple *item = kmalloc(sizeof(struct nat_mapping_original_tuple), GFP_ATOMIC);
   if (item == NULL) {
     pr_debug("xt_FULLCONENAT: ERROR: kmalloc() for nat_mapping_original_tuple failed.\n");
     return;
   }
   memcpy(&item->tuple, original_tuple, sizeof(struct nf_conntrack_tuple));
+  item->domain_id = mapping->domain->id;
+  item->peer_counted = 0;
+  if (outbound && (mapping->filter_mode & XT_FULLCONENAT_FILTER_MASK)) {
+    item->peer_counted = (peer_set_add(mapping, &(original_tuple->dst).u3, (original_tuple->dst).u.all) == 0);
+  }
   list_add(&item->node, &mapping->original_tuple_list);
+  tuple_owner_link(item);
   (mapping->refer_count)++;
 }
 
-static struct nat_mapping* get_mapping_by_ext_port(const uint16_t port, const int ifindex) {
+static void free_original_tuple(struct nat_mapping *mapping, struct nat_mapping_original_tuple *item) {
+  if (item->peer_counted) {
+    peer_set_del(mapping, &(item->tuple.dst).u3, (item->tuple.dst).u.all);
+  }
+  list_del(&item->node);
+  tuple_owner_unlink(item);
+  kfree(item);
+  (mapping->refer_count)--;
+}
+
+static struct nat_mapping* get_mapping_by_ext_port(struct fullconenat_domain *domain, const uint8_t family, const uint8_t protonum, const struct nf_conntrack_zone *zone, const uint16_t port, const int ifindex) {
   struct nat_mapping *p_current;
 
-  hash_for_each_possible(mapping_table_by_ext_port, p_current, node_by_ext_port, port) {
-    if (p_current->port == port && p_current->ifindex == ifindex) {
+  hlist_for_each_entry(p_current, DOMAIN_BUCKET(domain, by_ext_port, protonum, HASH_EXT_PORT(port, zone->id)), node_by_ext_port) {
+    if (p_current->port == port && p_current->ifindex == ifindex && p_current->family == family && p_current->zone.id == zone->id) {
       return p_current;
     }
   }
@@ -166,12 +978,13 @@ static struct nat_mapping* get_mapping_by_ext_port(const uint16_t port, const in
   return NULL;
 }
 
-static struct nat_mapping* get_mapping_by_int_src(const __be32 src_ip, const uint16_t src_port) {
+/* lock-free lookup by external address and port for the fullcone match.
+ * called under rcu_read_lock(); the mapping may be dying already. */
+static struct nat_mapping* get_mapping_by_ext_addr_rcu(struct fullconenat_domain *domain, const uint8_t family, const uint8_t protonum, const u16 zone_id, const union nf_inet_addr *addr, const uint16_t port) {
   struct nat_mapping *p_current;
-  u32 hash_src = HASH_2(src_ip, (u32)src_port);
 
-  hash_for_each_possible(mapping_table_by_int_src, p_current, node_by_int_src, hash_src) {
-    if (p_current->int_addr == src_ip && p_current->int_port == src_port) {
+  hlist_for_each_entry_rcu(p_current, DOMAIN_BUCKET(domain, by_ext_port, protonum, HASH_EXT_PORT(port, zone_id)), node_by_ext_port) {
+    if (p_current->port == port && p_current->family == family && p_current->zone.id == zone_id && nf_inet_addr_cmp(&p_current->ext_addr, addr)) {
       return p_current;
     }
   }
@@ -179,43 +992,301 @@ static struct nat_mapping* get_mapping_by_int_src(const __be32 src_ip, const uin
   return NULL;
 }
 
-static void kill_mapping(struct nat_mapping *mapping) {
+static struct nat_mapping* get_mapping_by_int_src(struct fullconenat_domain *domain, const uint8_t family, const uint8_t protonum, const struct nf_conntrack_zone *zone, const union nf_inet_addr *src_ip, const uint16_t src_port) {
+  struct nat_mapping *p_current;
+  u32 hash_src = HASH_INT_SRC(src_ip, src_port, zone->id);
+
+  hlist_for_each_entry(p_current, DOMAIN_BUCKET(domain, by_int_src, protonum, hash_src), node_by_int_src) {
+    if (nf_inet_addr_cmp(&p_current->int_addr, src_ip) && p_current->int_port == src_port && p_current->family == family && p_current->zone.id == zone->id) {
+      return p_current;
+    }
+  }
+
+  return NULL;
+}
+
+/* free a mapping that is no longer linked into its tables, or whose
+ * tables are going away. needs bh disabled, see log_mapping_event(). */
+static void release_mapping(struct nat_mapping *mapping) {
   struct list_head *iter, *tmp;
   struct nat_mapping_original_tuple *original_tuple_item;
 
-  if (mapping == NULL) {
-    return;
-  }
+  log_mapping_event(mapping, XT_FULLCONENAT_LOG_KILL);
+  fastpath_delete(mapping);
 
   list_for_each_safe(iter, tmp, &mapping->original_tuple_list) {
     original_tuple_item = list_entry(iter, struct nat_mapping_original_tuple, node);
     list_del(&original_tuple_item->node);
+    tuple_owner_unlink(original_tuple_item);
     kfree(original_tuple_item);
   }
 
-  hash_del(&mapping->node_by_ext_port);
-  hash_del(&mapping->node_by_int_src);
-  kfree(mapping);
+  kfree(mapping->peer_set);
+  kfree_rcu(mapping, rcu);
 }
 
-static void destroy_mappings(void) {
+static void kill_mapping(struct nat_mapping *mapping) {
+  if (mapping == NULL) {
+    return;
+  }
+
+  hlist_del_rcu(&mapping->node_by_ext_port);
+  hlist_del_rcu(&mapping->node_by_int_src);
+  if (mapping->port_claimed) {
+    clear_bit(mapping->port, mapping->domain->port_claims[proto_index(mapping->protonum)]);
+  }
+  mapping->domain->mappings--;
+  mapping->domain->killed++;
+  release_mapping(mapping);
+}
+
+static struct fullconenat_domain* domain_alloc(const char *name, const unsigned int bits) {
+  struct fullconenat_domain *domain;
+  struct hlist_head *buckets;
+  unsigned long *claims;
+  int proto;
+
+  domain = kzalloc(sizeof(struct fullconenat_domain), GFP_KERNEL);
+  if (domain == NULL) {
+    return NULL;
+  }
+
+  /* one allocation for both tables of every protocol */
+  buckets = kvzalloc(2 * FULLCONENAT_PROTO_MAX * sizeof(struct hlist_head) << bits, GFP_KERNEL);
+  claims = kvzalloc(FULLCONENAT_PROTO_MAX * BITS_TO_LONGS(65536) * sizeof(unsigned long), GFP_KERNEL);
+  domain->port_slice_cursor = alloc_percpu(uint16_t);
+  if (buckets == NULL || claims == NULL || domain->port_slice_cursor == NULL) {
+    kvfree(buckets);
+    kvfree(claims);
+    free_percpu(domain->port_slice_cursor);
+    kfree(domain);
+    return NULL;
+  }
+
+  for (proto = 0; proto < FULLCONENAT_PROTO_MAX; proto++) {
+    domain->by_ext_port[proto] = buckets + ((2 * proto) << bits);
+    domain->by_int_src[proto] = buckets + ((2 * proto + 1) << bits);
+    domain->port_claims[proto] = claims + proto * BITS_TO_LONGS(65536);
+  }
+
+  strscpy(domain->name, name, sizeof(domain->name));
+  domain->id = domain_next_id++;
+  spin_lock_init(&domain->lock);
+  domain->bits = bits;
+
+  return domain;
+}
+
+/* once its last rule is gone a domain is out of domain_list, and neither
+ * packets, the GC nor fastpath_map_fd_write() reach it any more. its
+ * mappings are then freed without the domain lock, in slices of buckets
+ * handed to work items of an unbound workqueue, which runs them on the
+ * online CPUs without tying them to one. the last slice frees the domain. */
+struct domain_teardown;
+
+struct teardown_slice {
+  struct work_struct work;
+  struct domain_teardown *teardown;
+  unsigned int first, last; /* bucket range in every table */
+};
+
+struct domain_teardown {
+  struct fullconenat_domain *domain;
+  atomic_t pending;         /* slices not done yet */
+  struct teardown_slice slices[];
+};
+
+static void teardown_buckets(struct fullconenat_domain *domain, const unsigned int first, const unsigned int last) {
   struct nat_mapping *p_current;
-  struct hlist_node *tmp;
-  int i;
+  unsigned int i, batch = 0;
+  int proto;
+
+  for (proto = 0; proto < FULLCONENAT_PROTO_MAX; proto++) {
+    for (i = first; i < last; i++) {
+      /* the by_int_src chains are dropped with the tables, unlinking is not
+       * needed. nothing else walks the chain, so it is popped from its head
+       * and the walk can pause in the middle of a long one. */
+      local_bh_disable();
+      while (!hlist_empty(&domain->by_ext_port[proto][i])) {
+        p_current = hlist_entry(domain->by_ext_port[proto][i].first, struct nat_mapping, node_by_ext_port);
+        hlist_del(&p_current->node_by_ext_port);
+        release_mapping(p_current);
+
+        if (++batch >= TEARDOWN_BATCH) {
+          batch = 0;
+          local_bh_enable();
+          cond_resched();
+          local_bh_disable();
+        }
+      }
+      local_bh_enable();
+    }
+  }
+}
+
+static void domain_release(struct fullconenat_domain *domain) {
+  kvfree(domain->by_ext_port[0]);
+  kvfree(domain->port_claims[0]);
+  free_percpu(domain->port_slice_cursor);
+  kfree(domain);
+}
+
+static void teardown_work(struct work_struct *work) {
+  struct teardown_slice *slice = container_of(work, struct teardown_slice, work);
+  struct domain_teardown *teardown = slice->teardown;
+
+  teardown_buckets(teardown->domain, slice->first, slice->last);
+
+  if (atomic_dec_and_test(&teardown->pending)) {
+    pr_debug("xt_FULLCONENAT: teardown_work(): domain \"%s\" freed\n", teardown->domain->name);
+    domain_release(teardown->domain);
+    kfree(teardown);
+  }
+}
+
+static void domain_free(struct fullconenat_domain *domain) {
+  struct domain_teardown *teardown = NULL;
+  struct teardown_slice *slice;
+  unsigned int buckets = 1U << domain->bits;
+  unsigned int nr_slices, i;
+
+  /* the mappings are spread evenly over the buckets, so slices of equal
+   * bucket ranges hold about the same number of them */
+  nr_slices = min3(num_online_cpus(), buckets, max(1U, DIV_ROUND_UP(domain->mappings, TEARDOWN_MIN_SLICE)));
+
+  if (teardown_wq != NULL) {
+    teardown = kzalloc(sizeof(struct domain_teardown) + nr_slices * sizeof(struct teardown_slice), GFP_KERNEL);
+  }
+  if (teardown == NULL) {
+    /* still in batches, only not in parallel */
+    teardown_buckets(domain, 0, buckets);
+    domain_release(domain);
+    return;
+  }
+
+  teardown->domain = domain;
+  atomic_set(&teardown->pending, nr_slices);
+
+  for (i = 0; i < nr_slices; i++) {
+    slice = &teardown->slices[i];
+    slice->teardown = teardown;
+    slice->first = buckets / nr_slices * i;
+    slice->last = (i == nr_slices - 1) ? buckets : buckets / nr_slices * (i + 1);
+    INIT_WORK(&slice->work, teardown_work);
+    queue_work(teardown_wq, &slice->work);
+  }
+}
+
+/* find or create the named domain for a rule. buckets is the table size
+ * the rule asks for, 0 if it does not care. an empty name selects the
+ * default domain. */
+static struct fullconenat_domain* domain_get(const char *name, const unsigned int buckets) {
+  struct fullconenat_domain *domain;
 
-  spin_lock_bh(&fullconenat_lock);
+  mutex_lock(&domain_list_lock);
 
-  hash_for_each_safe(mapping_table_by_ext_port, i, tmp, p_current, node_by_ext_port) {
-    kill_mapping(p_current);
+  list_for_each_entry(domain, &domain_list, list) {
+    if (strcmp(domain->name, name) == 0) {
+      if (buckets != 0 && buckets != (1U << domain->bits)) {
+        pr_info("xt_FULLCONENAT: domain \"%s\" already exists with %u buckets\n", name, 1U << domain->bits);
+        domain = ERR_PTR(-EEXIST);
+      } else {
+        domain->refer_count++;
+      }
+      mutex_unlock(&domain_list_lock);
+      return domain;
+    }
+  }
+
+  domain = domain_alloc(name, buckets != 0 ? ilog2(buckets) : HASHTABLE_BUCKET_BITS);
+  if (domain == NULL) {
+    mutex_unlock(&domain_list_lock);
+    return ERR_PTR(-ENOMEM);
   }
+  domain->refer_count = 1;
+  list_add_tail(&domain->list, &domain_list);
+
+  mutex_unlock(&domain_list_lock);
 
-  spin_unlock_bh(&fullconenat_lock);
+  pr_debug("xt_FULLCONENAT: domain_get(): domain \"%s\" created\n", name);
+
+  return domain;
+}
+
+/* the mappings of a domain go away with the last rule using it, freed
+ * in the background by domain_free(). */
+static void domain_put(struct fullconenat_domain *domain) {
+  mutex_lock(&domain_list_lock);
+
+  domain->refer_count--;
+  if (domain->refer_count > 0) {
+    domain = NULL;
+  } else {
+    list_del(&domain->list);
+  }
+
+  mutex_unlock(&domain_list_lock);
+
+  if (domain != NULL) {
+    pr_debug("xt_FULLCONENAT: domain_put(): domain \"%s\" released\n", domain->name);
+    domain_free(domain);
+  }
+}
+
+static int domains_show(struct seq_file *s, void *unused) {
+  struct fullconenat_domain *domain;
+
+  seq_printf(s, "%-31s %8s %5s %10s %12s %12s %12s\n",
+    "domain", "buckets", "refs", "mappings", "allocated", "killed", "exhausted");
+
+  mutex_lock(&domain_list_lock);
+
+  list_for_each_entry(domain, &domain_list, list) {
+    domain_lock(domain);
+    seq_printf(s, "%-31s %8u %5d %10u %12llu %12llu %12llu\n",
+      domain->name[0] != '\0' ? domain->name : "-", 1U << domain->bits, domain->refer_count,
+      domain->mappings, domain->allocated, domain->killed, domain->exhausted);
+    domain_unlock(domain);
+  }
+
+  mutex_unlock(&domain_list_lock);
+
+  return 0;
+}
+
+static int domains_open(struct inode *inode, struct file *file) {
+  return single_open(file, domains_show, NULL);
+}
+
+static const struct file_operations domains_fops = {
+  .owner = THIS_MODULE,
+  .open = domains_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+/* a TCP conntrack that is closing or in TIME_WAIT no longer needs its
+ * mapping, even though conntrack keeps it around for a while.
+ * flowtables only offload ESTABLISHED conntracks and put them back into
+ * that state on teardown, so offloaded flows keep their mapping. */
+static int ct_holds_mapping(const struct nf_conn *ct) {
+  if (nf_ct_protonum(ct) == IPPROTO_TCP) {
+    switch (READ_ONCE(ct->proto.tcp.state)) {
+    case TCP_CONNTRACK_TIME_WAIT:
+    case TCP_CONNTRACK_CLOSE:
+      return 0;
+    default:
+      break;
+    }
+  }
+  return 1;
 }
 
 /* check if a mapping is valid.
  * possibly delete and free an invalid mapping.
  * the mapping should not be used anymore after check_mapping() returns 0. */
-static int check_mapping(struct nat_mapping* mapping, struct net *net, const struct nf_conntrack_zone *zone) {
+static int check_mapping(struct nat_mapping* mapping, struct net *net) {
   struct list_head *iter, *tmp;
   struct nat_mapping_original_tuple *original_tuple_item;
   struct nf_conntrack_tuple_hash *tuple_hash;
@@ -225,7 +1296,7 @@ static int check_mapping(struct nat_mapping* mapping, struct net *net, const str
     return 0;
   }
 
-  if (mapping->port == 0 || mapping->int_addr == 0 || mapping->int_port == 0 || mapping->ifindex == -1) {
+  if (mapping->port == 0 || addr_is_zero(&mapping->int_addr) || mapping->int_port == 0 || mapping->ifindex == -1) {
     return 0;
   }
 
@@ -235,18 +1306,22 @@ static int check_mapping(struct nat_mapping* mapping, struct net *net, const str
   list_for_each_safe(iter, tmp, &mapping->original_tuple_list) {
     original_tuple_item = list_entry(iter, struct nat_mapping_original_tuple, node);
 
-    tuple_hash = nf_conntrack_find_get(net, zone, &original_tuple_item->tuple);
+    tuple_hash = nf_conntrack_find_get(net, &mapping->zone, &original_tuple_item->tuple);
 
     if (tuple_hash == NULL) {
       pr_debug("xt_FULLCONENAT: check_mapping(): tuple %s dying/unconfirmed. free this tuple.\n", nf_ct_stringify_tuple(&original_tuple_item->tuple));
 
-      list_del(&original_tuple_item->node);
-      kfree(original_tuple_item);
-      (mapping->refer_count)--;
+      free_original_tuple(mapping, original_tuple_item);
     } else {
       ct = nf_ct_tuplehash_to_ctrack(tuple_hash);
-      if (ct != NULL)
+      if (ct != NULL) {
+        if (!ct_holds_mapping(ct)) {
+          pr_debug("xt_FULLCONENAT: check_mapping(): tuple %s closing. free this tuple.\n", nf_ct_stringify_tuple(&original_tuple_item->tuple));
+
+          free_original_tuple(mapping, original_tuple_item);
+        }
         nf_ct_put(ct);
+      }
     }
 
   }
@@ -262,69 +1337,123 @@ static int check_mapping(struct nat_mapping* mapping, struct net *net, const str
   }
 }
 
+static void release_dying_tuple(struct nat_mapping *mapping, const struct nf_conntrack_tuple *dying_tuple) {
+  struct list_head *iter, *tmp;
+  struct nat_mapping_original_tuple *original_tuple_item;
+
+  if (mapping == NULL) {
+    return;
+  }
+
+  /* look for the corresponding out-dated tuple and free it */
+  list_for_each_safe(iter, tmp, &mapping->original_tuple_list) {
+    original_tuple_item = list_entry(iter, struct nat_mapping_original_tuple, node);
+
+    if (nf_ct_tuple_equal(&original_tuple_item->tuple, dying_tuple)) {
+      pr_debug("xt_FULLCONENAT: handle_dying_tuples(): tuple %s expired. free this tuple.\n",
+        nf_ct_stringify_tuple(&original_tuple_item->tuple));
+      free_original_tuple(mapping, original_tuple_item);
+    }
+  }
+
+  /* then kill the mapping if needed*/
+  pr_debug("xt_FULLCONENAT: handle_dying_tuples(): refer_count for mapping at ext_port %d is now %d\n", mapping->port, mapping->refer_count);
+  if (mapping->refer_count <= 0) {
+    pr_debug("xt_FULLCONENAT: handle_dying_tuples(): kill expired mapping at ext port %d\n", mapping->port);
+    kill_mapping(mapping);
+  }
+}
+
+static void free_tuple_list(struct list_head *list) {
+  struct list_head *iter, *tmp;
+  struct tuple_list *item;
+
+  list_for_each_safe(iter, tmp, list) {
+    item = list_entry(iter, struct tuple_list, list);
+    list_del(&item->list);
+    kfree(item);
+  }
+}
+
 static void handle_dying_tuples(void) {
-  struct list_head *iter, *tmp, *iter_2, *tmp_2;
   struct tuple_list *item;
   struct nf_conntrack_tuple *ct_tuple;
   struct nat_mapping *mapping;
-  __be32 ip;
-  uint16_t port;
-  struct nat_mapping_original_tuple *original_tuple_item;
+  struct fullconenat_domain *domain;
+  unsigned int batch;
+  int locked;
+  u64 start = 0;
+  LIST_HEAD(dying);
 
-  spin_lock_bh(&fullconenat_lock);
   spin_lock_bh(&dying_tuple_list_lock);
+  list_splice_init(&dying_tuple_list, &dying);
+  spin_unlock_bh(&dying_tuple_list_lock);
 
-  list_for_each_safe(iter, tmp, &dying_tuple_list) {
-    item = list_entry(iter, struct tuple_list, list);
+  if (list_empty(&dying)) {
+    return;
+  }
+
+  if (static_branch_unlikely(&stats_enabled)) {
+    start = local_clock();
+  }
+
+  list_for_each_entry(item, &dying, list) {
+    tuple_owners_lookup(item);
+  }
+
+  /* only the domains referencing a conntrack are locked and searched */
+  mutex_lock(&domain_list_lock);
+
+  list_for_each_entry(domain, &domain_list, list) {
+    locked = 0;
+    batch = 0;
+
+    list_for_each_entry(item, &dying, list) {
+      if (!tuple_owned_by(item, domain)) {
+        continue;
+      }
+
+      /* the batch is private to us, so the lock can be dropped in between
+       * to let packets through while a large batch is worked off. */
+      if (!locked) {
+        domain_lock(domain);
+        locked = 1;
+      } else if (++batch > GC_BATCH) {
+        batch = 0;
+        domain_unlock(domain);
+        cond_resched();
+        domain_lock(domain);
+      }
+
+      /* we dont know the conntrack direction for now so we try in both ways.
+       * a hairpinned conntrack is referenced by the mappings of both directions. */
+      ct_tuple = &(item->tuple_original);
+      mapping = get_mapping_by_int_src(domain, (ct_tuple->src).l3num, (ct_tuple->dst).protonum, &item->zone, &(ct_tuple->src).u3, be16_to_cpu((ct_tuple->src).u.all));
+      if (mapping != NULL) {
+        pr_debug("xt_FULLCONENAT: handle_dying_tuples(): OUTBOUND dying conntrack at ext port %d\n", mapping->port);
+        release_dying_tuple(mapping, &(item->tuple_original));
+      }
 
-    /* we dont know the conntrack direction for now so we try in both ways. */
-    ct_tuple = &(item->tuple_original); 
-    ip = (ct_tuple->src).u3.ip;
-    port = be16_to_cpu((ct_tuple->src).u.udp.port);
-    mapping = get_mapping_by_int_src(ip, port);
-    if (mapping == NULL) {
       ct_tuple = &(item->tuple_reply);
-      ip = (ct_tuple->src).u3.ip;
-      port = be16_to_cpu((ct_tuple->src).u.udp.port);
-      mapping = get_mapping_by_int_src(ip, port);
+      mapping = get_mapping_by_int_src(domain, (ct_tuple->src).l3num, (ct_tuple->dst).protonum, &item->zone, &(ct_tuple->src).u3, be16_to_cpu((ct_tuple->src).u.all));
       if (mapping != NULL) {
         pr_debug("xt_FULLCONENAT: handle_dying_tuples(): INBOUND dying conntrack at ext port %d\n", mapping->port);
+        release_dying_tuple(mapping, &(item->tuple_original));
       }
-    } else {
-      pr_debug("xt_FULLCONENAT: handle_dying_tuples(): OUTBOUND dying conntrack at ext port %d\n", mapping->port);
     }
 
-    if (mapping == NULL) {
-      goto next;
+    if (locked) {
+      domain_unlock(domain);
     }
+  }
 
-    /* look for the corresponding out-dated tuple and free it */
-    list_for_each_safe(iter_2, tmp_2, &mapping->original_tuple_list) {
-      original_tuple_item = list_entry(iter_2, struct nat_mapping_original_tuple, node);
+  mutex_unlock(&domain_list_lock);
 
-      if (nf_ct_tuple_equal(&original_tuple_item->tuple, &(item->tuple_original))) {
-        pr_debug("xt_FULLCONENAT: handle_dying_tuples(): tuple %s expired. free this tuple.\n",
-          nf_ct_stringify_tuple(&original_tuple_item->tuple));
-        list_del(&original_tuple_item->node);
-        kfree(original_tuple_item);
-        (mapping->refer_count)--;
-      }
-    }
-
-    /* then kill the mapping if needed*/
-    pr_debug("xt_FULLCONENAT: handle_dying_tuples(): refer_count for mapping at ext_port %d is now %d\n", mapping->port, mapping->refer_count);
-    if (mapping->refer_count <= 0) {
-      pr_debug("xt_FULLCONENAT: handle_dying_tuples(): kill expired mapping at ext port %d\n", mapping->port);
-      kill_mapping(mapping);
-    }
+  free_tuple_list(&dying);
 
-next:
-    list_del(&item->list);
-    kfree(item);
+  if (static_branch_unlikely(&stats_enabled) && start != 0) {
+    stats_record(STATS_GC_BATCH, local_clock() - start);
   }
-
-  spin_unlock_bh(&dying_tuple_list_lock);
-  spin_unlock_bh(&fullconenat_lock);
 }
 
 static void gc_worker(struct work_struct *work) {
@@ -354,7 +1483,7 @@ static int ct_event_cb(unsigned int events, const struct nf_ct_event *item) {
   ct_tuple_reply = &(ct->tuplehash[IP_CT_DIR_REPLY].tuple);
 
   protonum = (ct_tuple_original->dst).protonum;
-  if (protonum != IPPROTO_UDP) {
+  if (proto_index(protonum) < 0) {
     return 0;
   }
 
@@ -367,60 +1496,252 @@ static int ct_event_cb(unsigned int events, const struct nf_ct_event *item) {
 
   memcpy(&(dying_tuple_item->tuple_original), ct_tuple_original, sizeof(struct nf_conntrack_tuple));
   memcpy(&(dying_tuple_item->tuple_reply), ct_tuple_reply, sizeof(struct nf_conntrack_tuple));
+  dying_tuple_item->zone = *nf_ct_zone(ct);
 
   spin_lock_bh(&dying_tuple_list_lock);
 
-  list_add(&(dying_tuple_item->list), &dying_tuple_list);
+  list_add(&(dying_tuple_item->list), &dying_tuple_list);
+
+  spin_unlock_bh(&dying_tuple_list_lock);
+
+  if (wq != NULL)
+    queue_delayed_work(wq, &gc_worker_wk, msecs_to_jiffies(100));
+
+  return 0;
+}
+
+static __be32 get_device_ip(const struct net_device* dev) {
+  struct in_device* in_dev;
+  struct in_ifaddr* if_info;
+  __be32 result;
+
+  if (dev == NULL) {
+    return 0;
+  }
+
+  rcu_read_lock();
+  in_dev = dev->ip_ptr;
+  if (in_dev == NULL) {
+    rcu_read_unlock();
+    return 0;
+  }
+  if_info = in_dev->ifa_list;
+  if (if_info) {
+    result = if_info->ifa_local;
+    rcu_read_unlock();
+    return result;
+  } else {
+    rcu_read_unlock();
+    return 0;
+  }
+}
+
+/* the source address the outbound device would pick, as MASQUERADE does. */
+static int get_device_addr(struct net *net, const uint8_t family, const struct sk_buff *skb, union nf_inet_addr *addr) {
+  memset(addr, 0, sizeof(union nf_inet_addr));
+
+  if (family == NFPROTO_IPV4) {
+    addr->ip = get_device_ip(skb->dev);
+    return addr->ip != 0 ? 0 : -EADDRNOTAVAIL;
+  }
+#if IS_ENABLED(CONFIG_IPV6)
+  return ipv6_dev_get_saddr(net, skb->dev, &ipv6_hdr(skb)->daddr, 0, &addr->in6);
+#else
+  return -EAFNOSUPPORT;
+#endif
+}
+
+/* the index of the interface owning a local address, or 0. */
+static int get_local_addr_ifindex(struct net *net, const uint8_t family, const union nf_inet_addr *addr) {
+  struct net_device *net_dev;
+  int ifindex = 0;
+
+  if (family == NFPROTO_IPV4) {
+    net_dev = ip_dev_find(net, addr->ip);
+    if (net_dev != NULL) {
+      ifindex = net_dev->ifindex;
+      dev_put(net_dev);
+    }
+  }
+#if IS_ENABLED(CONFIG_IPV6) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+  else {
+    rcu_read_lock();
+    net_dev = ipv6_dev_find(net, &addr->in6, NULL);
+    if (net_dev != NULL) {
+      ifindex = net_dev->ifindex;
+    }
+    rcu_read_unlock();
+  }
+#endif
+
+  return ifindex;
+}
+
+static void nat_port_range(const struct nf_nat_range2 *range, uint16_t *min, uint16_t *range_size) {
+  if (range->flags & NF_NAT_RANGE_PROTO_SPECIFIED) {
+    *min = be16_to_cpu((range->min_proto).all);
+    *range_size = be16_to_cpu((range->max_proto).all) - *min + 1;
+  } else {
+    /* minimum port is 1024. same behavior as default linux NAT. */
+    *min = 1024;
+    *range_size = 65535 - *min + 1;
+  }
+}
+
+/* with --cpu-partition the port range is split into one slice per online
+ * CPU, numbered by port_slices_rebuild(). a range too small to give every
+ * CPU a port is split into single ports. the last slice also takes the
+ * remainder of the range. */
+static unsigned int cpu_slices(const uint16_t range_size) {
+  return clamp_t(unsigned int, READ_ONCE(nr_port_slices), 1, range_size);
+}
+
+static void cpu_slice_bounds(const uint16_t min, const uint16_t range_size, const unsigned int nr_slices, const unsigned int slice, unsigned int *slice_min, unsigned int *slice_len) {
+  unsigned int slice_size = range_size / nr_slices;
+
+  *slice_min = min + slice * slice_size;
+  *slice_len = (slice == nr_slices - 1) ? range_size - slice * slice_size : slice_size;
+}
+
+/* claim a free port for a --cpu-partition rule, called with the domain
+ * lock held. the bitmap finds a free port without probing the mapping
+ * tables one port at a time. each CPU claims from its own slice, going on from where it stopped
+ * last time, and only steals from the other slices once its own one runs
+ * dry. a port is free when no mapping holds its bit in port_claims, so
+ * ports are not shared between zones or interfaces in such a domain.
+ * returns -1 if every port of the range is claimed. */
+static int claim_port_in_cpu_slices(struct fullconenat_domain *domain, const uint8_t protonum, const uint16_t original_port, const struct nf_nat_range2 *range, unsigned int *probes) {
+  unsigned long *claims = domain->port_claims[proto_index(protonum)];
+  unsigned int nr_slices, local, n, slice, slice_min, slice_len, start, end, bit, pass;
+  uint16_t min, range_size;
+  int random;
+
+  nat_port_range(range, &min, &range_size);
+  random = (range->flags & NF_NAT_RANGE_PROTO_RANDOM)
+    || (range->flags & NF_NAT_RANGE_PROTO_RANDOM_FULLY);
+
+  nr_slices = cpu_slices(range_size);
+  local = this_cpu_read(port_slice_index) % nr_slices;
+
+  for (n = 0; n < nr_slices; n++) {
+    slice = (local + n) % nr_slices;
+    cpu_slice_bounds(min, range_size, nr_slices, slice, &slice_min, &slice_len);
+
+    if (n == 0 && !random && original_port >= slice_min && original_port < slice_min + slice_len) {
+      /* try to preserve the port if it's in our slice and available */
+      (*probes)++;
+      if (!test_and_set_bit(original_port, claims)) {
+        return original_port;
+      }
+    }
+
+    if (random) {
+      start = get_random_u32() % slice_len;
+    } else if (n == 0) {
+      start = this_cpu_read(*domain->port_slice_cursor) % slice_len;
+    } else {
+      start = 0;
+    }
+
+    /* [start, slice_len) first, then wrap around to [0, start) */
+    for (pass = 0; pass < 2; pass++) {
+      bit = slice_min + (pass == 0 ? start : 0);
+      end = slice_min + (pass == 0 ? slice_len : start);
+
+      bit = find_next_zero_bit(claims, end, bit);
+      if (bit < end) {
+        (*probes)++;
+        set_bit(bit, claims);
+        if (n == 0) {
+          this_cpu_write(*domain->port_slice_cursor, bit - slice_min + 1);
+        }
+        return bit;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/* every port of the range is claimed. called with the domain lock held:
+ * look for a mapping in our own slice that turns out to be dead, which
+ * check_mapping() kills and so frees its port, or at least we tried and
+ * override a previous mapping in our own slice. */
+static uint16_t reclaim_port_in_cpu_slice(struct fullconenat_domain *domain, struct net *net, const uint8_t family, const uint8_t protonum, const struct nf_conntrack_zone *zone, const int ifindex, const struct nf_nat_range2 *range, int *claimed, unsigned int *probes) {
+  unsigned long *claims = domain->port_claims[proto_index(protonum)];
+  unsigned int nr_slices, slice_min, slice_len, i;
+  uint16_t min, range_size, selected;
+  struct nat_mapping *mapping;
+
+  nat_port_range(range, &min, &range_size);
+  nr_slices = cpu_slices(range_size);
+  cpu_slice_bounds(min, range_size, nr_slices, this_cpu_read(port_slice_index) % nr_slices, &slice_min, &slice_len);
 
-  spin_unlock_bh(&dying_tuple_list_lock);
+  for (i = 0; i < slice_len; i++) {
+    selected = slice_min + i;
+    (*probes)++;
+    mapping = get_mapping_by_ext_port(domain, family, protonum, zone, selected, ifindex);
+    if (mapping != NULL && !check_mapping(mapping, net) && !test_and_set_bit(selected, claims)) {
+      *claimed = 1;
+      return selected;
+    }
+  }
 
-  if (wq != NULL)
-    queue_delayed_work(wq, &gc_worker_wk, msecs_to_jiffies(100));
+  i = this_cpu_read(*domain->port_slice_cursor) % slice_len;
+  this_cpu_write(*domain->port_slice_cursor, i + 1);
+  selected = slice_min + i;
+  mapping = get_mapping_by_ext_port(domain, family, protonum, zone, selected, ifindex);
+  kill_mapping(mapping);
+  domain->exhausted++;
 
-  return 0;
+  /* the port may still be held by a mapping of another zone or interface */
+  *claimed = !test_and_set_bit(selected, claims);
+  return selected;
 }
 
-static __be32 get_device_ip(const struct net_device* dev) {
-  struct in_device* in_dev;
-  struct in_ifaddr* if_info;
-  __be32 result;
+/* hand the claim on want_port over to a new mapping. if the NAT core
+ * picked another port, the mapping claims that one if it can. without a
+ * mapping the claim is given back. */
+static void mapping_take_claim(struct fullconenat_domain *domain, struct nat_mapping *mapping, const uint8_t protonum, const uint16_t want_port, const int claimed) {
+  unsigned long *claims;
 
-  if (dev == NULL) {
-    return 0;
+  if (!claimed) {
+    return;
   }
 
-  rcu_read_lock();
-  in_dev = dev->ip_ptr;
-  if (in_dev == NULL) {
-    rcu_read_unlock();
-    return 0;
+  claims = domain->port_claims[proto_index(protonum)];
+  if (mapping == NULL || mapping->port != want_port) {
+    clear_bit(want_port, claims);
   }
-  if_info = in_dev->ifa_list;
-  if (if_info) {
-    result = if_info->ifa_local;
-    rcu_read_unlock();
-    return result;
-  } else {
-    rcu_read_unlock();
-    return 0;
+  if (mapping != NULL) {
+    mapping->port_claimed = mapping->port == want_port || !test_and_set_bit(mapping->port, claims);
   }
 }
 
-static uint16_t find_appropriate_port(struct net *net, const struct nf_conntrack_zone *zone, const uint16_t original_port, const int ifindex, const struct nf_nat_ipv4_range *range) {
+/* called with the domain lock held. *claimed tells whether the port was
+ * claimed in port_claims for a --cpu-partition range. */
+static uint16_t __find_appropriate_port(struct fullconenat_domain *domain, struct net *net, const uint8_t family, const uint8_t protonum, const struct nf_conntrack_zone *zone, const uint16_t original_port, const int ifindex, const struct nf_nat_range2 *range, int *claimed, unsigned int *probes) {
   uint16_t min, start, selected, range_size, i;
   struct nat_mapping* mapping = NULL;
+  int random, claim;
 
-  if (range->flags & NF_NAT_RANGE_PROTO_SPECIFIED) {
-    min = be16_to_cpu((range->min).udp.port);
-    range_size = be16_to_cpu((range->max).udp.port) - min + 1;
-  } else {
-    /* minimum port is 1024. same behavior as default linux NAT. */
-    min = 1024;
-    range_size = 65535 - min + 1;
+  *claimed = 0;
+
+  if (range->flags & XT_FULLCONENAT_CPU_PARTITION) {
+    claim = claim_port_in_cpu_slices(domain, protonum, original_port, range, probes);
+    if (claim >= 0) {
+      *claimed = 1;
+      return claim;
+    }
+    return reclaim_port_in_cpu_slice(domain, net, family, protonum, zone, ifindex, range, claimed, probes);
   }
 
-  if ((range->flags & NF_NAT_RANGE_PROTO_RANDOM)
-    || (range->flags & NF_NAT_RANGE_PROTO_RANDOM_FULLY)) {
+  nat_port_range(range, &min, &range_size);
+
+  random = (range->flags & NF_NAT_RANGE_PROTO_RANDOM)
+    || (range->flags & NF_NAT_RANGE_PROTO_RANDOM_FULLY);
+
+  if (random) {
     /* for now we do the same thing for both --random and --random-fully */
 
     /* select a random starting point */
@@ -430,8 +1751,9 @@ static uint16_t find_appropriate_port(struct net *net, const struct nf_conntrack
     if ((original_port >= min && original_port <= min + range_size - 1)
       || !(range->flags & NF_NAT_RANGE_PROTO_SPECIFIED)) {
       /* 1. try to preserve the port if it's available */
-      mapping = get_mapping_by_ext_port(original_port, ifindex);
-      if (mapping == NULL || !(check_mapping(mapping, net, zone))) {
+      (*probes)++;
+      mapping = get_mapping_by_ext_port(domain, family, protonum, zone, original_port, ifindex);
+      if (mapping == NULL || !(check_mapping(mapping, net))) {
         return original_port;
       }
     }
@@ -443,65 +1765,74 @@ static uint16_t find_appropriate_port(struct net *net, const struct nf_conntrack
   for (i = 0; i < range_size; i++) {
     /* 2. try to find an available port */
     selected = min + ((start + i) % range_size);
-    mapping = get_mapping_by_ext_port(selected, ifindex);
-    if (mapping == NULL || !(check_mapping(mapping, net, zone))) {
+    (*probes)++;
+    mapping = get_mapping_by_ext_port(domain, family, protonum, zone, selected, ifindex);
+    if (mapping == NULL || !(check_mapping(mapping, net))) {
       return selected;
     }
   }
 
   /* 3. at least we tried. override a previous mapping. */
   selected = min + start;
-  mapping = get_mapping_by_ext_port(selected, ifindex);
+  mapping = get_mapping_by_ext_port(domain, family, protonum, zone, selected, ifindex);
   kill_mapping(mapping);
+  domain->exhausted++;
 
   return selected;
 }
 
-static unsigned int fullconenat_tg(struct sk_buff *skb, const struct xt_action_param *par)
-{
-  const struct nf_nat_ipv4_multi_range_compat *mr;
-  const struct nf_nat_ipv4_range *range;
+static uint16_t find_appropriate_port(struct fullconenat_domain *domain, struct net *net, const uint8_t family, const uint8_t protonum, const struct nf_conntrack_zone *zone, const uint16_t original_port, const int ifindex, const struct nf_nat_range2 *range, int *claimed) {
+  unsigned int probes = 0;
+  uint16_t selected;
+
+  selected = __find_appropriate_port(domain, net, family, protonum, zone, original_port, ifindex, range, claimed, &probes);
+  if (static_branch_unlikely(&stats_enabled)) {
+    stats_record(STATS_PORT_PROBES, probes);
+  }
+
+  return selected;
+}
 
+/* family independent part of the target. range holds the rule's
+ * addresses and ports together with the XT_FULLCONENAT_* flags,
+ * domain the tables the rule's mappings live in. */
+static unsigned int __fullconenat_tg(struct sk_buff *skb, const struct xt_action_param *par, const struct nf_nat_range2 *range, struct fullconenat_domain *domain)
+{
   const struct nf_conntrack_zone *zone;
   struct net *net;
   struct nf_conn *ct;
   enum ip_conntrack_info ctinfo;
   struct nf_conntrack_tuple *ct_tuple, *ct_tuple_origin;
 
-  struct net_device *net_dev;
-
   struct nat_mapping *mapping, *src_mapping;
   unsigned int ret;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
-  struct nf_nat_range2 newrange;
-#else
-  struct nf_nat_range newrange;
-#endif
+  struct nf_nat_range2 newrange, hairpin_range;
 
-  __be32 new_ip, ip;
+  union nf_inet_addr new_ip, ip, peer_addr;
+  __be16 peer_port;
   uint16_t port, original_port, want_port;
-  uint8_t protonum;
-  int ifindex;
+  uint8_t protonum, family;
+  int ifindex, local_ifindex, hairpin, claimed;
+  const struct nf_nat_range2 *snat_range;
 
-  ip = 0;
+  memset(&ip, 0, sizeof(ip));
   original_port = 0;
+  want_port = 0;
+  claimed = 0;
   src_mapping = NULL;
 
-  mr = par->targinfo;
-  range = &mr->range[0];
-
   mapping = NULL;
   ret = XT_CONTINUE;
 
   ct = nf_ct_get(skb, &ctinfo);
   net = nf_ct_net(ct);
   zone = nf_ct_zone(ct);
+  family = nf_ct_l3num(ct);
 
-  memset(&newrange.min_addr, 0, sizeof(newrange.min_addr));
-  memset(&newrange.max_addr, 0, sizeof(newrange.max_addr));
-  newrange.flags       = mr->range[0].flags | NF_NAT_RANGE_MAP_IPS;
-  newrange.min_proto   = mr->range[0].min;
-  newrange.max_proto   = mr->range[0].max;
+  memset(&newrange, 0, sizeof(newrange));
+  newrange.flags       = (range->flags & ~XT_FULLCONENAT_FLAG_MASK) | NF_NAT_RANGE_MAP_IPS;
+  newrange.min_proto   = range->min_proto;
+  newrange.max_proto   = range->max_proto;
 
   if (xt_hooknum(par) == NF_INET_PRE_ROUTING) {
     /* inbound packets */
@@ -510,45 +1841,120 @@ static unsigned int fullconenat_tg(struct sk_buff *skb, const struct xt_action_p
     ct_tuple_origin = &(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
 
     protonum = (ct_tuple_origin->dst).protonum;
-    if (protonum != IPPROTO_UDP) {
+    if (proto_index(protonum) < 0) {
       return ret;
     }
-    ip = (ct_tuple_origin->dst).u3.ip;
-    port = be16_to_cpu((ct_tuple_origin->dst).u.udp.port);
+    ip = (ct_tuple_origin->dst).u3;
+    port = be16_to_cpu((ct_tuple_origin->dst).u.all);
 
     /* get the corresponding ifindex by the dst_ip (aka. external ip of this host),
      * in case the packet needs to be forwarded from another inbound interface. */
-    net_dev = ip_dev_find(net, ip);
-    if (net_dev != NULL) {
-      ifindex = net_dev->ifindex;
-      dev_put(net_dev);
+    hairpin = 0;
+    local_ifindex = get_local_addr_ifindex(net, family, &ip);
+    if (local_ifindex != 0) {
+      /* with --hairpin, a packet arriving on another interface than the one
+       * owning the dst_ip comes from the inside and is NATed in both directions. */
+      hairpin = (range->flags & XT_FULLCONENAT_HAIRPIN) && local_ifindex != ifindex;
+      ifindex = local_ifindex;
+    } else if (range->flags & XT_FULLCONENAT_HAIRPIN) {
+      return ret;
     }
 
-    spin_lock_bh(&fullconenat_lock);
+    domain_lock(domain);
 
     /* find an active mapping based on the inbound port */
-    mapping = get_mapping_by_ext_port(port, ifindex);
+    mapping = get_mapping_by_ext_port(domain, family, protonum, zone, port, ifindex);
     if (mapping == NULL) {
-      spin_unlock_bh(&fullconenat_lock);
+      domain_unlock(domain);
       return ret;
     }
-    if (check_mapping(mapping, net, zone)) {
+    if (check_mapping(mapping, net)) {
+      peer_addr = (ct_tuple_origin->src).u3;
+      peer_port = (ct_tuple_origin->src).u.all;
+
+      if (hairpin) {
+        /* hairpin: the inside source is seen by the mapped host at its own
+         * external mapping, exactly as a remote peer would see it. */
+        original_port = be16_to_cpu((ct_tuple_origin->src).u.all);
+        /* the mapping is the same outbound flows would get, so unless the
+         * rule names its own ports it comes from the port pool of the
+         * POSTROUTING rule of this protocol and netns. */
+        snat_range = range;
+        if (!(range->flags & NF_NAT_RANGE_PROTO_SPECIFIED) && domain->snat_range_net[proto_index(protonum)] == net) {
+          snat_range = &domain->snat_range[proto_index(protonum)];
+        }
+        src_mapping = get_mapping_by_int_src(domain, family, protonum, zone, &(ct_tuple_origin->src).u3, original_port);
+        if (src_mapping != NULL && src_mapping->ifindex == ifindex && check_mapping(src_mapping, net)) {
+          want_port = src_mapping->port;
+        } else {
+          want_port = find_appropriate_port(domain, net, family, protonum, zone, original_port, ifindex, snat_range, &claimed);
+          src_mapping = NULL;
+        }
+
+        memset(&hairpin_range, 0, sizeof(hairpin_range));
+        hairpin_range.flags = NF_NAT_RANGE_MAP_IPS | NF_NAT_RANGE_PROTO_SPECIFIED;
+        hairpin_range.min_addr = ip;
+        hairpin_range.max_addr = ip;
+        hairpin_range.min_proto.all = cpu_to_be16(want_port);
+        hairpin_range.max_proto = hairpin_range.min_proto;
+
+        /* the port search may have recycled mappings, look the destination up again. */
+        mapping = get_mapping_by_ext_port(domain, family, protonum, zone, port, ifindex);
+        if (mapping == NULL) {
+          mapping_take_claim(domain, NULL, protonum, want_port, claimed);
+          domain_unlock(domain);
+          return ret;
+        }
+
+        peer_addr = ip;
+        peer_port = cpu_to_be16(want_port);
+      }
+
+      if (!mapping_allows_peer(mapping, &peer_addr, peer_port)) {
+        pr_debug("xt_FULLCONENAT: <INBOUND FILTERED> %s\n", nf_ct_stringify_tuple(ct_tuple_origin));
+        mapping_take_claim(domain, NULL, protonum, want_port, claimed);
+        domain_unlock(domain);
+        return ret;
+      }
+
       newrange.flags = NF_NAT_RANGE_MAP_IPS | NF_NAT_RANGE_PROTO_SPECIFIED;
-      newrange.min_addr.ip = mapping->int_addr;
-      newrange.max_addr.ip = mapping->int_addr;
-      newrange.min_proto.udp.port = cpu_to_be16(mapping->int_port);
+      newrange.min_addr = mapping->int_addr;
+      newrange.max_addr = mapping->int_addr;
+      newrange.min_proto.all = cpu_to_be16(mapping->int_port);
       newrange.max_proto = newrange.min_proto;
 
-      pr_debug("xt_FULLCONENAT: <INBOUND DNAT> %s ==> %pI4:%d\n", nf_ct_stringify_tuple(ct_tuple_origin), &mapping->int_addr, mapping->int_port);
+      pr_debug("xt_FULLCONENAT: <INBOUND DNAT> %s ==> port %d\n", nf_ct_stringify_tuple(ct_tuple_origin), mapping->int_port);
 
       ret = nf_nat_setup_info(ct, &newrange, HOOK2MANIP(xt_hooknum(par)));
 
+      if (ret == NF_ACCEPT && hairpin) {
+        /* the SNAT half is applied by the NAT core in POSTROUTING/INPUT,
+         * no other rule is consulted for this conntrack. */
+        ret = nf_nat_setup_info(ct, &hairpin_range, NF_NAT_MANIP_SRC);
+
+        if (ret == NF_ACCEPT) {
+          ct_tuple = &(ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+          pr_debug("xt_FULLCONENAT: <HAIRPIN SNAT> %s ==> %d\n", nf_ct_stringify_tuple(ct_tuple_origin), be16_to_cpu((ct_tuple->dst).u.all));
+
+          if (src_mapping == NULL) {
+            src_mapping = allocate_mapping(domain, net, family, protonum, zone, &(ct_tuple_origin->src).u3, original_port, &ip, be16_to_cpu((ct_tuple->dst).u.all), ifindex, snat_range->flags & XT_FULLCONENAT_FILTER_MASK);
+            mapping_take_claim(domain, src_mapping, protonum, want_port, claimed);
+            claimed = 0;
+          }
+          if (src_mapping != NULL) {
+            add_original_tuple_to_mapping(src_mapping, ct_tuple_origin, 1);
+          }
+        }
+      }
+
       if (ret == NF_ACCEPT) {
-        add_original_tuple_to_mapping(mapping, ct_tuple_origin);
+        add_original_tuple_to_mapping(mapping, ct_tuple_origin, 0);
         pr_debug("xt_FULLCONENAT: fullconenat_tg(): INBOUND: refer_count for mapping at ext_port %d is now %d\n", mapping->port, mapping->refer_count);
       }
+      /* the hairpin SNAT failed */
+      mapping_take_claim(domain, NULL, protonum, want_port, claimed);
     }
-    spin_unlock_bh(&fullconenat_lock);
+    domain_unlock(domain);
     return ret;
 
 
@@ -559,30 +1965,46 @@ static unsigned int fullconenat_tg(struct sk_buff *skb, const struct xt_action_p
     ct_tuple_origin = &(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
     protonum = (ct_tuple_origin->dst).protonum;
 
-    spin_lock_bh(&fullconenat_lock);
+    if(range->flags & NF_NAT_RANGE_MAP_IPS) {
+      newrange.min_addr = range->min_addr;
+      newrange.max_addr = range->max_addr;
+    } else {
+      if (get_device_addr(net, family, skb, &new_ip) != 0) {
+        return NF_DROP;
+      }
+      newrange.min_addr = new_ip;
+      newrange.max_addr = new_ip;
+    }
+
+    domain_lock(domain);
+
+    if (proto_index(protonum) >= 0) {
+      domain->snat_range[proto_index(protonum)] = *range;
+      domain->snat_range_net[proto_index(protonum)] = net;
 
-    if (protonum == IPPROTO_UDP) {
-      ip = (ct_tuple_origin->src).u3.ip;
-      original_port = be16_to_cpu((ct_tuple_origin->src).u.udp.port);
+      ip = (ct_tuple_origin->src).u3;
+      original_port = be16_to_cpu((ct_tuple_origin->src).u.all);
 
-      src_mapping = get_mapping_by_int_src(ip, original_port);
-      if (src_mapping != NULL && check_mapping(src_mapping, net, zone)) {
+      src_mapping = get_mapping_by_int_src(domain, family, protonum, zone, &ip, original_port);
+      if (src_mapping != NULL && check_mapping(src_mapping, net)) {
 
         /* outbound nat: if a previously established mapping is active,
          * we will reuse that mapping. */
 
         newrange.flags = NF_NAT_RANGE_MAP_IPS | NF_NAT_RANGE_PROTO_SPECIFIED;
-        newrange.min_proto.udp.port = cpu_to_be16(src_mapping->port);
+        newrange.min_proto.all = cpu_to_be16(src_mapping->port);
         newrange.max_proto = newrange.min_proto;
 
       } else {
 
         /* if not, we find a new external port to map to.
-         * the SNAT may fail so we should re-check the mapped port later. */
-        want_port = find_appropriate_port(net, zone, original_port, ifindex, range);
+         * the SNAT may fail so we should re-check the mapped port later.
+         * the lock stays held until the mapping is inserted, so the first
+         * packets of one source on several CPUs end up in one mapping. */
+        want_port = find_appropriate_port(domain, net, family, protonum, zone, original_port, ifindex, range, &claimed);
 
         newrange.flags = NF_NAT_RANGE_MAP_IPS | NF_NAT_RANGE_PROTO_SPECIFIED;
-        newrange.min_proto.udp.port = cpu_to_be16(want_port);
+        newrange.min_proto.all = cpu_to_be16(want_port);
         newrange.max_proto = newrange.min_proto;
 
         src_mapping = NULL;
@@ -590,50 +2012,133 @@ static unsigned int fullconenat_tg(struct sk_buff *skb, const struct xt_action_p
       }
     }
 
-    if(mr->range[0].flags & NF_NAT_RANGE_MAP_IPS) {
-      newrange.min_addr.ip = mr->range[0].min_ip;
-      newrange.max_addr.ip = mr->range[0].max_ip;
-    } else {
-      new_ip = get_device_ip(skb->dev);
-      newrange.min_addr.ip = new_ip;
-      newrange.max_addr.ip = new_ip;
-    }
-
     /* do SNAT now */
     ret = nf_nat_setup_info(ct, &newrange, HOOK2MANIP(xt_hooknum(par)));
 
-    if (protonum != IPPROTO_UDP || ret != NF_ACCEPT) {
-      /* for non-UDP packets and failed SNAT, bailout */
-      spin_unlock_bh(&fullconenat_lock);
+    if (proto_index(protonum) < 0 || ret != NF_ACCEPT) {
+      /* for other protocols and failed SNAT, bailout */
+      mapping_take_claim(domain, NULL, protonum, want_port, claimed);
+      domain_unlock(domain);
       return ret;
     }
 
     /* the reply tuple contains the mapped port. */
     ct_tuple = &(ct->tuplehash[IP_CT_DIR_REPLY].tuple);
     /* this is the resulted mapped port. */
-    port = be16_to_cpu((ct_tuple->dst).u.udp.port);
+    port = be16_to_cpu((ct_tuple->dst).u.all);
 
     pr_debug("xt_FULLCONENAT: <OUTBOUND SNAT> %s ==> %d\n", nf_ct_stringify_tuple(ct_tuple_origin), port);
 
     /* save the mapping information into our mapping table */
     mapping = src_mapping;
-    if (mapping == NULL || !check_mapping(mapping, net, zone)) {
-      mapping = allocate_mapping(ip, original_port, port, ifindex);
+    if (mapping == NULL || !check_mapping(mapping, net)) {
+      if (claimed) {
+        /* port_claims does not know the ports of rules without
+         * --cpu-partition in the same domain. the new flow wins. */
+        kill_mapping(get_mapping_by_ext_port(domain, family, protonum, zone, port, ifindex));
+      }
+      mapping = allocate_mapping(domain, net, family, protonum, zone, &ip, original_port, &(ct_tuple->dst).u3, port, ifindex, range->flags & XT_FULLCONENAT_FILTER_MASK);
+      mapping_take_claim(domain, mapping, protonum, want_port, claimed);
     }
     if (mapping != NULL) {
-      add_original_tuple_to_mapping(mapping, ct_tuple_origin);
+      add_original_tuple_to_mapping(mapping, ct_tuple_origin, 1);
       pr_debug("xt_FULLCONENAT: fullconenat_tg(): OUTBOUND: refer_count for mapping at ext_port %d is now %d\n", mapping->port, mapping->refer_count);
     }
 
-    spin_unlock_bh(&fullconenat_lock);
+    domain_unlock(domain);
     return ret;
   }
 
   return ret;
 }
 
-static int fullconenat_tg_check(const struct xt_tgchk_param *par)
+static unsigned int fullconenat_tg(struct sk_buff *skb, const struct xt_action_param *par, const struct nf_nat_range2 *range, struct fullconenat_domain *domain)
+{
+  unsigned int ret;
+  u64 start;
+
+  if (!static_branch_unlikely(&stats_enabled)) {
+    return __fullconenat_tg(skb, par, range, domain);
+  }
+
+  start = local_clock();
+  ret = __fullconenat_tg(skb, par, range, domain);
+  stats_record(STATS_TG_TIME, local_clock() - start);
+
+  return ret;
+}
+
+static void range_from_nf_nat_range(struct nf_nat_range2 *range, const struct nf_nat_range *r)
+{
+  memset(range, 0, sizeof(struct nf_nat_range2));
+  range->flags = r->flags;
+  range->min_addr = r->min_addr;
+  range->max_addr = r->max_addr;
+  range->min_proto = r->min_proto;
+  range->max_proto = r->max_proto;
+}
+
+static unsigned int fullconenat_tg4(struct sk_buff *skb, const struct xt_action_param *par)
+{
+  const struct nf_nat_ipv4_multi_range_compat *mr = par->targinfo;
+  struct nf_nat_range2 range;
+
+  memset(&range, 0, sizeof(range));
+  range.flags = mr->range[0].flags;
+  range.min_addr.ip = mr->range[0].min_ip;
+  range.max_addr.ip = mr->range[0].max_ip;
+  range.min_proto = mr->range[0].min;
+  range.max_proto = mr->range[0].max;
+
+  return fullconenat_tg(skb, par, &range, default_domain);
+}
+
+static unsigned int fullconenat_tg6(struct sk_buff *skb, const struct xt_action_param *par)
+{
+  struct nf_nat_range2 range;
+
+  range_from_nf_nat_range(&range, par->targinfo);
+
+  return fullconenat_tg(skb, par, &range, default_domain);
+}
+
+static unsigned int fullconenat_tg_v1(struct sk_buff *skb, const struct xt_action_param *par)
+{
+  const struct xt_fullconenat_tginfo *info = par->targinfo;
+  struct nf_nat_range2 range;
+
+  range_from_nf_nat_range(&range, &info->range);
+
+  return fullconenat_tg(skb, par, &range, info->d);
+}
+
+static int fullconenat_tg_check(const struct xt_tgchk_param *par, const unsigned int flags)
 {
+  int ret;
+
+  if ((flags & XT_FULLCONENAT_FILTER_MASK) == XT_FULLCONENAT_FILTER_MASK) {
+    pr_info("xt_FULLCONENAT: only one filtering mode may be selected\n");
+    return -EINVAL;
+  }
+
+  if (flags & XT_FULLCONENAT_HAIRPIN) {
+    if (par->hook_mask & ~(1 << NF_INET_PRE_ROUTING)) {
+      pr_info("xt_FULLCONENAT: --hairpin is only valid in PREROUTING\n");
+      return -EINVAL;
+    }
+    /* the SNAT half always uses the address of the mapping reached */
+    if (flags & NF_NAT_RANGE_MAP_IPS) {
+      pr_info("xt_FULLCONENAT: --hairpin takes no --to-source\n");
+      return -EINVAL;
+    }
+  }
+
+  /* every rule holds its own reference, so v4 and v6 rules may come and go in any order. */
+  ret = nf_ct_netns_get(par->net, par->family);
+  if (ret < 0) {
+    return ret;
+  }
+
   mutex_lock(&nf_ct_net_event_lock);
 
   tg_refer_count++;
@@ -641,7 +2146,6 @@ static int fullconenat_tg_check(const struct xt_tgchk_param *par)
   pr_debug("xt_FULLCONENAT: fullconenat_tg_check(): tg_refer_count is now %d\n", tg_refer_count);
 
   if (tg_refer_count == 1) {
-    nf_ct_netns_get(par->net, par->family);
 #ifdef CONFIG_NF_CONNTRACK_CHAIN_EVENTS
     ct_event_notifier.notifier_call = ct_event_cb;
 #else
@@ -659,6 +2163,47 @@ static int fullconenat_tg_check(const struct xt_tgchk_param *par)
   return 0;
 }
 
+static int fullconenat_tg4_check(const struct xt_tgchk_param *par)
+{
+  const struct nf_nat_ipv4_multi_range_compat *mr = par->targinfo;
+
+  return fullconenat_tg_check(par, mr->range[0].flags);
+}
+
+static int fullconenat_tg6_check(const struct xt_tgchk_param *par)
+{
+  const struct nf_nat_range *range = par->targinfo;
+
+  return fullconenat_tg_check(par, range->flags);
+}
+
+static int fullconenat_tg_check_v1(const struct xt_tgchk_param *par)
+{
+  struct xt_fullconenat_tginfo *info = par->targinfo;
+  int ret;
+
+  if (strnlen(info->domain, sizeof(info->domain)) == sizeof(info->domain)) {
+    return -EINVAL;
+  }
+  if (info->buckets != 0 && (!is_power_of_2(info->buckets)
+    || info->buckets < DOMAIN_MIN_BUCKETS || info->buckets > DOMAIN_MAX_BUCKETS)) {
+    pr_info("xt_FULLCONENAT: domain size must be a power of 2 between %u and %u\n", DOMAIN_MIN_BUCKETS, DOMAIN_MAX_BUCKETS);
+    return -EINVAL;
+  }
+
+  info->d = domain_get(info->domain, info->buckets);
+  if (IS_ERR(info->d)) {
+    return PTR_ERR(info->d);
+  }
+
+  ret = fullconenat_tg_check(par, info->range.flags);
+  if (ret < 0) {
+    domain_put(info->d);
+  }
+
+  return ret;
+}
+
 static void fullconenat_tg_destroy(const struct xt_tgdtor_param *par)
 {
   mutex_lock(&nf_ct_net_event_lock);
@@ -675,10 +2220,19 @@ static void fullconenat_tg_destroy(const struct xt_tgdtor_param *par)
       pr_debug("xt_FULLCONENAT: fullconenat_tg_destroy(): ct_event_notifier unregistered\n");
 
     }
-    nf_ct_netns_put(par->net, par->family);
   }
 
   mutex_unlock(&nf_ct_net_event_lock);
+
+  nf_ct_netns_put(par->net, par->family);
+}
+
+static void fullconenat_tg_destroy_v1(const struct xt_tgdtor_param *par)
+{
+  const struct xt_fullconenat_tginfo *info = par->targinfo;
+
+  fullconenat_tg_destroy(par);
+  domain_put(info->d);
 }
 
 static struct xt_target tg_reg[] __read_mostly = {
@@ -686,29 +2240,304 @@ static struct xt_target tg_reg[] __read_mostly = {
   .name       = "FULLCONENAT",
   .family     = NFPROTO_IPV4,
   .revision   = 0,
-  .target     = fullconenat_tg,
+  .target     = fullconenat_tg4,
   .targetsize = sizeof(struct nf_nat_ipv4_multi_range_compat),
   .table      = "nat",
   .hooks      = (1 << NF_INET_PRE_ROUTING) |
                 (1 << NF_INET_POST_ROUTING),
-  .checkentry = fullconenat_tg_check,
+  .checkentry = fullconenat_tg4_check,
+  .destroy    = fullconenat_tg_destroy,
+  .me         = THIS_MODULE,
+ },
+#if IS_ENABLED(CONFIG_IPV6)
+ {
+  .name       = "FULLCONENAT",
+  .family     = NFPROTO_IPV6,
+  .revision   = 0,
+  .target     = fullconenat_tg6,
+  .targetsize = sizeof(struct nf_nat_range),
+  .table      = "nat",
+  .hooks      = (1 << NF_INET_PRE_ROUTING) |
+                (1 << NF_INET_POST_ROUTING),
+  .checkentry = fullconenat_tg6_check,
   .destroy    = fullconenat_tg_destroy,
   .me         = THIS_MODULE,
  },
+#endif
+ {
+  .name       = "FULLCONENAT",
+  .family     = NFPROTO_IPV4,
+  .revision   = 1,
+  .target     = fullconenat_tg_v1,
+  .targetsize = sizeof(struct xt_fullconenat_tginfo),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+  .usersize   = offsetof(struct xt_fullconenat_tginfo, d),
+#endif
+  .table      = "nat",
+  .hooks      = (1 << NF_INET_PRE_ROUTING) |
+                (1 << NF_INET_POST_ROUTING),
+  .checkentry = fullconenat_tg_check_v1,
+  .destroy    = fullconenat_tg_destroy_v1,
+  .me         = THIS_MODULE,
+ },
+#if IS_ENABLED(CONFIG_IPV6)
+ {
+  .name       = "FULLCONENAT",
+  .family     = NFPROTO_IPV6,
+  .revision   = 1,
+  .target     = fullconenat_tg_v1,
+  .targetsize = sizeof(struct xt_fullconenat_tginfo),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+  .usersize   = offsetof(struct xt_fullconenat_tginfo, d),
+#endif
+  .table      = "nat",
+  .hooks      = (1 << NF_INET_PRE_ROUTING) |
+                (1 << NF_INET_POST_ROUTING),
+  .checkentry = fullconenat_tg_check_v1,
+  .destroy    = fullconenat_tg_destroy_v1,
+  .me         = THIS_MODULE,
+ },
+#endif
+};
+
+/* fullcone match: the destination of the packet is an existing mapping.
+ * works without conntrack, e.g. in the raw table. */
+static bool fullcone_mt(const struct sk_buff *skb, struct xt_action_param *par)
+{
+  const struct xt_fullcone_mtinfo *info = par->matchinfo;
+  union nf_inet_addr daddr;
+  __be16 _ports[2];
+  const __be16 *ports;
+  unsigned int thoff = 0;
+  uint8_t protonum, family;
+#if IS_ENABLED(CONFIG_IPV6)
+  unsigned short fragoff = 0;
+  int ret;
+#endif
+  bool mapped;
+
+  family = xt_family(par);
+  memset(&daddr, 0, sizeof(daddr));
+
+  /* later fragments carry no ports */
+#if IS_ENABLED(CONFIG_IPV6)
+  if (family == NFPROTO_IPV6) {
+    ret = ipv6_find_hdr(skb, &thoff, -1, &fragoff, NULL);
+    if (ret < 0 || fragoff != 0) {
+      return info->flags & XT_FULLCONE_INVERT;
+    }
+    protonum = ret;
+    daddr.in6 = ipv6_hdr(skb)->daddr;
+  } else
+#endif
+  {
+    if (ip_hdr(skb)->frag_off & htons(IP_OFFSET)) {
+      return info->flags & XT_FULLCONE_INVERT;
+    }
+    protonum = ip_hdr(skb)->protocol;
+    daddr.ip = ip_hdr(skb)->daddr;
+    thoff = ip_hdrlen(skb);
+  }
+
+  if (proto_index(protonum) < 0) {
+    return info->flags & XT_FULLCONE_INVERT;
+  }
+
+  ports = skb_header_pointer(skb, thoff, sizeof(_ports), _ports);
+  if (ports == NULL) {
+    par->hotdrop = true;
+    return false;
+  }
+
+  rcu_read_lock();
+  mapped = get_mapping_by_ext_addr_rcu(info->d, family, protonum, info->zone, &daddr, be16_to_cpu(ports[1])) != NULL;
+  rcu_read_unlock();
+
+  return mapped ^ !!(info->flags & XT_FULLCONE_INVERT);
+}
+
+static int fullcone_mt_check(const struct xt_mtchk_param *par)
+{
+  struct xt_fullcone_mtinfo *info = par->matchinfo;
+
+  if (strnlen(info->domain, sizeof(info->domain)) == sizeof(info->domain)) {
+    return -EINVAL;
+  }
+  if (info->flags & ~XT_FULLCONE_INVERT) {
+    return -EINVAL;
+  }
+
+  info->d = domain_get(info->domain, 0);
+  if (IS_ERR(info->d)) {
+    return PTR_ERR(info->d);
+  }
+
+  return 0;
+}
+
+static void fullcone_mt_destroy(const struct xt_mtdtor_param *par)
+{
+  const struct xt_fullcone_mtinfo *info = par->matchinfo;
+
+  domain_put(info->d);
+}
+
+static struct xt_match mt_reg[] __read_mostly = {
+ {
+  .name       = "fullcone",
+  .family     = NFPROTO_IPV4,
+  .revision   = 0,
+  .match      = fullcone_mt,
+  .matchsize  = sizeof(struct xt_fullcone_mtinfo),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+  .usersize   = offsetof(struct xt_fullcone_mtinfo, d),
+#endif
+  .checkentry = fullcone_mt_check,
+  .destroy    = fullcone_mt_destroy,
+  .me         = THIS_MODULE,
+ },
+#if IS_ENABLED(CONFIG_IPV6)
+ {
+  .name       = "fullcone",
+  .family     = NFPROTO_IPV6,
+  .revision   = 0,
+  .match      = fullcone_mt,
+  .matchsize  = sizeof(struct xt_fullcone_mtinfo),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+  .usersize   = offsetof(struct xt_fullcone_mtinfo, d),
+#endif
+  .checkentry = fullcone_mt_check,
+  .destroy    = fullcone_mt_destroy,
+  .me         = THIS_MODULE,
+ },
+#endif
 };
 
+/* number the online CPUs for the --cpu-partition slices, leaving out a
+ * CPU that is going down. slices of CPUs that come and go are only
+ * reached by stealing meanwhile, the claimed ports stay where they are. */
+static void port_slices_rebuild(const int going_down) {
+  unsigned int n = 0;
+  int cpu;
+
+  for_each_online_cpu(cpu) {
+    if (cpu != going_down) {
+      per_cpu(port_slice_index, cpu) = n++;
+    }
+  }
+  WRITE_ONCE(nr_port_slices, max(n, 1U));
+}
+
+static int port_slices_cpu_online(unsigned int cpu) {
+  port_slices_rebuild(-1);
+  return 0;
+}
+
+static int port_slices_cpu_offline(unsigned int cpu) {
+  port_slices_rebuild(cpu);
+  return 0;
+}
+
 static int __init fullconenat_tg_init(void)
 {
+  unsigned int i;
+  int ret;
+
+  peer_set_seed = get_random_u32();
+  tuple_owner_seed = get_random_u32();
+  for (i = 0; i < ARRAY_SIZE(tuple_owner_locks); i++) {
+    spin_lock_init(&tuple_owner_locks[i]);
+  }
+
+  port_slices_hp_state = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "netfilter/xt_FULLCONENAT:online", port_slices_cpu_online, port_slices_cpu_offline);
+  if (port_slices_hp_state < 0) {
+    printk("xt_FULLCONENAT: warning: failed to follow CPU hotplug, --cpu-partition slices are fixed\n");
+    cpus_read_lock();
+    port_slices_rebuild(-1);
+    cpus_read_unlock();
+  }
+
+  teardown_wq = alloc_workqueue("xt_FULLCONENAT_teardown", WQ_UNBOUND, 0);
+  if (teardown_wq == NULL) {
+    printk("xt_FULLCONENAT: warning: failed to create teardown workqueue\n");
+  }
+
+  /* the default domain lives as long as the module */
+  default_domain = domain_get("", 0);
+  if (IS_ERR(default_domain)) {
+    if (teardown_wq) {
+      destroy_workqueue(teardown_wq);
+    }
+    if (port_slices_hp_state >= 0) {
+      cpuhp_remove_state_nocalls(port_slices_hp_state);
+    }
+    return PTR_ERR(default_domain);
+  }
+
+  debugfs_root = debugfs_create_dir("xt_FULLCONENAT", NULL);
+  if (IS_ERR_OR_NULL(debugfs_root)) {
+    printk("xt_FULLCONENAT: warning: failed to create debugfs directory\n");
+    debugfs_root = NULL;
+  }
+
+  if (log_mappings) {
+    if (debugfs_root != NULL) {
+      log_chan = relay_open("mapping_log", debugfs_root, log_subbuf_size, log_n_subbufs, &log_relay_callbacks, NULL);
+    }
+    if (log_chan == NULL) {
+      printk("xt_FULLCONENAT: warning: failed to open mapping log\n");
+    } else {
+      debugfs_create_file("mapping_log_dropped", 0600, debugfs_root, NULL, &log_dropped_fops);
+    }
+  }
+
+  if (debugfs_root != NULL) {
+    debugfs_create_file("domains", 0400, debugfs_root, NULL, &domains_fops);
+    debugfs_create_file("stats_enabled", 0600, debugfs_root, NULL, &stats_enabled_fops);
+    debugfs_create_file("latency_histograms", 0600, debugfs_root, NULL, &stats_fops);
+#if IS_ENABLED(CONFIG_BPF_SYSCALL)
+    debugfs_create_file("bpf_map_fd", 0200, debugfs_root, NULL, &fastpath_map_fd_fops);
+#endif
+  }
+
   wq = create_singlethread_workqueue("xt_FULLCONENAT");
   if (wq == NULL) {
     printk("xt_FULLCONENAT: warning: failed to create workqueue\n");
   }
 
-  return xt_register_targets(tg_reg, ARRAY_SIZE(tg_reg));
+  ret = xt_register_targets(tg_reg, ARRAY_SIZE(tg_reg));
+  if (ret == 0) {
+    ret = xt_register_matches(mt_reg, ARRAY_SIZE(mt_reg));
+    if (ret < 0) {
+      xt_unregister_targets(tg_reg, ARRAY_SIZE(tg_reg));
+    }
+  }
+  if (ret < 0) {
+    if (wq) {
+      destroy_workqueue(wq);
+      wq = NULL;
+    }
+    if (log_chan) {
+      relay_close(log_chan);
+      log_chan = NULL;
+    }
+    domain_put(default_domain);
+    if (teardown_wq) {
+      destroy_workqueue(teardown_wq);
+      teardown_wq = NULL;
+    }
+    if (port_slices_hp_state >= 0) {
+      cpuhp_remove_state_nocalls(port_slices_hp_state);
+    }
+    debugfs_remove_recursive(debugfs_root);
+  }
+
+  return ret;
 }
 
 static void fullconenat_tg_exit(void)
 {
+  xt_unregister_matches(mt_reg, ARRAY_SIZE(mt_reg));
   xt_unregister_targets(tg_reg, ARRAY_SIZE(tg_reg));
 
   if (wq) {
@@ -717,14 +2546,40 @@ static void fullconenat_tg_exit(void)
     destroy_workqueue(wq);
   }
 
-  handle_dying_tuples();
-  destroy_mappings();
+  /* every domain is going away, the refcounts of dying conntracks no
+   * longer matter. */
+  spin_lock_bh(&dying_tuple_list_lock);
+  free_tuple_list(&dying_tuple_list);
+  spin_unlock_bh(&dying_tuple_list_lock);
+
+  domain_put(default_domain);
+
+  /* waits for all teardowns, including those of earlier removed rules.
+   * they may still log and update the BPF map. */
+  if (teardown_wq) {
+    destroy_workqueue(teardown_wq);
+  }
+  fastpath_release();
+
+  if (port_slices_hp_state >= 0) {
+    cpuhp_remove_state_nocalls(port_slices_hp_state);
+  }
+
+  if (log_chan) {
+    relay_close(log_chan);
+    log_chan = NULL;
+  }
+  debugfs_remove_recursive(debugfs_root);
 }
 
 module_init(fullconenat_tg_init);
 module_exit(fullconenat_tg_exit);
 
 MODULE_LICENSE("GPL");
-MODULE_DESCRIPTION("Xtables: implementation of RFC3489 full cone NAT");
+MODULE_DESCRIPTION("Xtables: implementation of RFC3489 full cone NAT, and a match for its mappings");
 MODULE_AUTHOR("Chion Tang <tech@chionlab.moe>");
 MODULE_ALIAS("ipt_FULLCONENAT");
+MODULE_ALIAS("ip6t_FULLCONENAT");
+MODULE_ALIAS("xt_fullcone");
+MODULE_ALIAS("ipt_fullcone");
+MODULE_ALIAS("ip6t_fullcone");
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2018 Chion Tang <tech@chionlab.moe>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _XT_FULLCONENAT_H
+#define _XT_FULLCONENAT_H
+
+#include <linux/types.h>
+#include <linux/netfilter/nf_nat.h>
+
+/* FULLCONENAT private flags. They are carried in the upper half of
+ * the range flags, which the NAT core does not use, and are masked
+ * off before the range is handed to nf_nat_setup_info(). */
+#define XT_FULLCONENAT_FLAG_MASK          0xffff0000U
+
+/* RFC 4787 filtering behavior. Neither bit set means
+ * endpoint-independent filtering (the default). */
+#define XT_FULLCONENAT_FILTER_ADDR        (1U << 16)
+#define XT_FULLCONENAT_FILTER_ADDR_PORT   (1U << 17)
+#define XT_FULLCONENAT_FILTER_MASK        (XT_FULLCONENAT_FILTER_ADDR | XT_FULLCONENAT_FILTER_ADDR_PORT)
+
+/* PREROUTING on the inside interface: NAT packets sent to a mapped
+ * external address:port in both directions. */
+#define XT_FULLCONENAT_HAIRPIN            (1U << 18)
+
+/* allocate new ports from per-CPU slices of the port range */
+#define XT_FULLCONENAT_CPU_PARTITION      (1U << 19)
+
+#define XT_FULLCONENAT_DOMAIN_LEN         32
+
+/* revision 1 target info, the same for IPv4 and IPv6. Rules naming the
+ * same domain share one set of mapping tables, lock and port pool; an
+ * empty name selects the default domain of revision 0 rules. */
+struct xt_fullconenat_tginfo {
+  struct nf_nat_range range;
+  __u32 buckets;       /* table size when the domain is created, 0 for the default */
+  char  domain[XT_FULLCONENAT_DOMAIN_LEN];
+
+  /* used internally by the kernel */
+  struct fullconenat_domain *d __attribute__((aligned(8)));
+};
+
+/* fullcone match: the destination address and port of the packet are
+ * those of an existing mapping in the given domain and conntrack zone. */
+#define XT_FULLCONE_INVERT                0x01
+
+struct xt_fullcone_mtinfo {
+  __u16 zone;
+  __u8  flags;         /* XT_FULLCONE_* */
+  __u8  pad;
+  char  domain[XT_FULLCONENAT_DOMAIN_LEN];
+
+  /* used internally by the kernel */
+  struct fullconenat_domain *d __attribute__((aligned(8)));
+};
+
+/* mapping log events */
+enum {
+  XT_FULLCONENAT_LOG_ALLOCATE = 1,
+  XT_FULLCONENAT_LOG_KILL     = 2,
+};
+
+/* fixed-size binary record written for every mapping allocation and
+ * removal to the per-CPU relay files mapping_log<cpu> in debugfs. */
+struct xt_fullconenat_log_record {
+  __u64  timestamp_ns; /* CLOCK_REALTIME */
+  __u8   event;        /* XT_FULLCONENAT_LOG_* */
+  __u8   family;       /* AF_INET or AF_INET6 */
+  __u16  zone;         /* conntrack zone id */
+  __s32  ifindex;      /* external interface index */
+  __be32 int_addr[4];
+  __be32 ext_addr[4];
+  __be16 int_port;
+  __be16 ext_port;
+  __u8   l4proto;      /* IPPROTO_UDP, IPPROTO_TCP or IPPROTO_UDPLITE */
+  __u8   reserved[3];
+};
+
+/* key and value of the BPF hash map the module keeps in sync with the
+ * IPv4 UDP mappings, for the tc fast path in fullconenat_fastpath.bpf.c. */
+struct xt_fullconenat_bpf_key {
+  __be32 ext_addr;
+  __be16 ext_port;
+  __u8   l4proto;
+  __u8   pad;
+};
+
+struct xt_fullconenat_bpf_value {
+  __be32 int_addr;
+  __be16 int_port;
+  __u16  pad;
+  __s32  ifindex;      /* external interface index */
+};
+
+#endif /* _XT_FULLCONENAT_H */